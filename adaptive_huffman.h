@@ -0,0 +1,185 @@
+#ifndef ADAPTIVE_HUFFMAN_H_
+#define ADAPTIVE_HUFFMAN_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#include "bstream.h"
+
+// Huffman code updated after every symbol with the FGK algorithm, so that
+// the coder and the decoder keep the same code without writing it. Symbols
+// are the 256 byte values and kEndSymbol. A symbol not seen yet is written
+// as the code of the NYT (not yet transmitted) leaf, then in 9 bits.
+//
+// The nodes are numbered so that weights never decrease with the number
+// and children come before their parent, the root being the last node.
+class AdaptiveHuffmanTree {
+ public:
+  // Symbol marking the end of a stream
+  static const int kEndSymbol = 256;
+
+  AdaptiveHuffmanTree();
+
+  // Write the code of symbol, then update the code
+  void Encode(int symbol, BinaryOutputStream &output);
+
+  // Read a symbol, then update the code
+  int Decode(BinaryInputStream &input);
+
+ private:
+  static const int kNumSymbols = 257;
+  static const int kSymbolBits = 9;
+  // Every symbol and the NYT leaf, and the nodes joining them
+  static const int kMaxNodes = 2 * (kNumSymbols + 1) - 1;
+  static const int16_t kRoot = kMaxNodes - 1;
+  // Index of the children of a leaf, and symbol of the other nodes
+  static const int16_t kNone = -1;
+
+  struct Node {
+    uint64_t weight;
+    int16_t parent;
+    int16_t left, right;
+    int16_t symbol;
+  };
+
+  Node nodes[kMaxNodes];
+  // Leaf of every symbol, kNone if not seen yet
+  int16_t leaves[kNumSymbols];
+  int16_t nyt;
+
+  // Add one to the weight of symbol, and keep the nodes in order
+  void Update(int symbol);
+
+  // Return the last node with the weight of node
+  int16_t Leader(int16_t node);
+
+  // Exchange the subtrees at a and b
+  void Swap(int16_t a, int16_t b);
+};
+
+const int AdaptiveHuffmanTree::kEndSymbol;
+const int AdaptiveHuffmanTree::kNumSymbols;
+const int AdaptiveHuffmanTree::kSymbolBits;
+const int AdaptiveHuffmanTree::kMaxNodes;
+const int16_t AdaptiveHuffmanTree::kRoot;
+const int16_t AdaptiveHuffmanTree::kNone;
+
+// Objective: Start with the NYT leaf alone as the root
+AdaptiveHuffmanTree::AdaptiveHuffmanTree() : nyt(kRoot) {
+  nodes[kRoot] = Node{0, kNone, kNone, kNone, kNone};
+  std::fill(leaves, leaves + kNumSymbols, kNone);
+}
+
+// Objective: Write the branches from the root to the leaf of the symbol,
+//            collected from the leaf up, up to 32 at once
+void AdaptiveHuffmanTree::Encode(int symbol, BinaryOutputStream &output) {
+  if (symbol < 0 || symbol >= kNumSymbols)
+    throw std::out_of_range("Symbol out of range");
+
+  int16_t leaf = leaves[symbol] != kNone ? leaves[symbol] : nyt;
+  int16_t path[kMaxNodes];
+  size_t depth = 0;
+  for (int16_t node = leaf; node != kRoot; node = nodes[node].parent)
+    path[depth++] = node;
+
+  while (depth) {
+    size_t length = std::min<size_t>(depth, 32);
+    uint32_t bits = 0;
+    for (size_t i = 0; i < length; i++) {
+      int16_t node = path[--depth];
+      bits = (bits << 1) | (nodes[nodes[node].parent].right == node);
+    }
+    output.PutBits(bits, length);
+  }
+
+  if (leaf == nyt)
+    output.PutBits(symbol, kSymbolBits);
+  Update(symbol);
+}
+
+// Objective: Follow the branches from the root to a leaf
+int AdaptiveHuffmanTree::Decode(BinaryInputStream &input) {
+  int16_t node = kRoot;
+  while (nodes[node].left != kNone)
+    node = input.GetBit() ? nodes[node].right : nodes[node].left;
+
+  int symbol = nodes[node].symbol;
+  if (node == nyt) {
+    symbol = input.GetBits(kSymbolBits);
+    // A new symbol must be one not seen yet
+    if (symbol >= kNumSymbols || leaves[symbol] != kNone)
+      throw std::runtime_error("Corrupted zap file");
+  }
+
+  Update(symbol);
+  return symbol;
+}
+
+// Objective: Increment the weights from the leaf of the symbol to the root.
+// Concept: Before a node is incremented, it takes the place of the last node
+//          of the same weight, its parent aside, so that the weights still
+//          don't decrease with the number once it is incremented.
+void AdaptiveHuffmanTree::Update(int symbol) {
+  int16_t node = leaves[symbol];
+
+  // A new symbol splits the NYT leaf into a new NYT leaf and its own leaf
+  if (node == kNone) {
+    int16_t parent = nyt;
+    node = parent - 1;
+    nyt = parent - 2;
+    nodes[node] = Node{0, parent, kNone, kNone, static_cast<int16_t>(symbol)};
+    nodes[nyt] = Node{0, parent, kNone, kNone, kNone};
+    nodes[parent].left = nyt;
+    nodes[parent].right = node;
+    leaves[symbol] = node;
+  }
+
+  for (;;) {
+    int16_t leader = Leader(node);
+    if (leader != node && leader != nodes[node].parent) {
+      Swap(node, leader);
+      node = leader;
+    }
+
+    nodes[node].weight++;
+    if (node == kRoot)
+      break;
+    node = nodes[node].parent;
+  }
+}
+
+// Objective: Search the nodes from node to the root, whose weights are in
+//            order, for the last one of the same weight
+int16_t AdaptiveHuffmanTree::Leader(int16_t node) {
+  uint64_t weight = nodes[node].weight;
+  const Node *last = std::upper_bound(
+      nodes + node, nodes + kMaxNodes, weight,
+      [](uint64_t value, const Node &n) { return value < n.weight; });
+  return static_cast<int16_t>(last - nodes - 1);
+}
+
+// Objective: Exchange the contents of the nodes, which stay at their place
+//            under their parent, and point the children and the leaves to
+//            the new places
+void AdaptiveHuffmanTree::Swap(int16_t a, int16_t b) {
+  std::swap(nodes[a].weight, nodes[b].weight);
+  std::swap(nodes[a].left, nodes[b].left);
+  std::swap(nodes[a].right, nodes[b].right);
+  std::swap(nodes[a].symbol, nodes[b].symbol);
+
+  for (int16_t node : {a, b}) {
+    Node &n = nodes[node];
+    if (n.left != kNone) {
+      nodes[n.left].parent = node;
+      nodes[n.right].parent = node;
+    } else if (n.symbol != kNone) {
+      leaves[n.symbol] = node;
+    } else {
+      nyt = node;
+    }
+  }
+}
+
+#endif  // ADAPTIVE_HUFFMAN_H_
@@ -0,0 +1,45 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+// Every benchmark prints one CSV row: its name, the number of units it
+// processed (bytes, bits or operations), the unit, the seconds taken and the
+// millions of units per second. Rows of different benchmarks can be
+// concatenated under a single header.
+
+// Print the header of the benchmark rows
+void ReportHeader() {
+  std::cout << "benchmark,count,unit,seconds,m_per_s" << std::endl;
+}
+
+// Print the row of a benchmark
+void Report(const std::string &name, size_t count, const std::string &unit,
+            double seconds) {
+  std::cout << name << ',' << count << ',' << unit << ',' << seconds << ','
+            << count / seconds / 1e6 << std::endl;
+}
+
+// Return the seconds taken by fn()
+template <typename F>
+double TimeSeconds(F fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  auto stop = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+// Make a result look used, so that the computation of a benchmark isn't
+// optimized away
+template <typename T>
+void KeepAlive(const T &value) {
+  static volatile T sink;
+  sink = value;
+  (void)sink;
+}
+
+#endif  // BENCH_H_
@@ -0,0 +1,86 @@
+#include <sstream>
+#include <string>
+
+#include "bench.h"
+#include "bstream.h"
+
+// Write count values with put(output, i) and return the seconds taken,
+// the bytes written are returned in coded
+template <typename F>
+double TimePut(size_t count, std::string &coded, F put) {
+  std::ostringstream oss(std::ios::out | std::ios::binary);
+
+  double seconds = TimeSeconds([&]() {
+    BinaryOutputStream output(oss);
+    for (size_t i = 0; i < count; i++)
+      put(output, i);
+  });
+
+  coded = oss.str();
+  return seconds;
+}
+
+// Read count values with get(input) from coded and return the seconds taken
+template <typename F>
+double TimeGet(size_t count, const std::string &coded, F get) {
+  std::istringstream iss(coded, std::ios::in | std::ios::binary);
+  size_t sum = 0;
+
+  double seconds = TimeSeconds([&]() {
+    BinaryInputStream input(iss);
+    for (size_t i = 0; i < count; i++)
+      sum += get(input);
+  });
+
+  KeepAlive(sum);
+  return seconds;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = argc > 1 ? std::stoul(argv[1]) : 1 << 24;
+  std::string bits, chars, ints, codes;
+
+  ReportHeader();
+
+  Report("bstream_put_bit", count, "ops",
+         TimePut(count, bits, [](BinaryOutputStream &output, size_t i) {
+           output.PutBit(i % 3 == 0);
+         }));
+  Report("bstream_put_char", count, "ops",
+         TimePut(count, chars, [](BinaryOutputStream &output, size_t i) {
+           output.PutChar(static_cast<char>(i));
+         }));
+  Report("bstream_put_int", count, "ops",
+         TimePut(count, ints, [](BinaryOutputStream &output, size_t i) {
+           output.PutInt(static_cast<int>(i));
+         }));
+  // Codes of 1 to 13 bits, as written by the encoder
+  Report("bstream_put_bits", count, "ops",
+         TimePut(count, codes, [](BinaryOutputStream &output, size_t i) {
+           output.PutBits(i, 1 + i % 13);
+         }));
+
+  Report("bstream_get_bit", count, "ops",
+         TimeGet(count, bits, [](BinaryInputStream &input) {
+           return input.GetBit();
+         }));
+  Report("bstream_get_char", count, "ops",
+         TimeGet(count, chars, [](BinaryInputStream &input) {
+           return input.GetChar();
+         }));
+  Report("bstream_get_int", count, "ops",
+         TimeGet(count, ints, [](BinaryInputStream &input) {
+           return input.GetInt();
+         }));
+
+  // Codes looked up in a table, then consumed
+  size_t i = 0;
+  Report("bstream_peek_consume_bits", count, "ops",
+         TimeGet(count, codes, [&](BinaryInputStream &input) {
+           uint32_t bits = input.PeekBits(13);
+           input.ConsumeBits(1 + i++ % 13);
+           return bits;
+         }));
+
+  return 0;
+}
@@ -0,0 +1,373 @@
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "huffman.h"
+#include "mapped_file.h"
+
+// Access to the steps of Huffman::Compress
+class HuffmanBench {
+ public:
+  static std::vector<size_t> CountInputFreq(const std::string &data) {
+    std::vector<size_t> freq;
+    Huffman::CountInputFreq(data.data(), data.size(), freq);
+    return freq;
+  }
+
+  static std::vector<uint8_t> BuildTree(std::vector<size_t> &freq) {
+    HuffmanTree tree;
+    std::vector<uint8_t> lengths;
+    Huffman::BuildTree(freq, tree);
+    Huffman::CodeLengths(tree, lengths);
+    return lengths;
+  }
+
+  static uint32_t BuildTable(std::vector<uint8_t> &lengths) {
+    std::vector<Huffman::HuffmanCode> code_table;
+    Huffman::BuildTable(lengths, code_table);
+    return code_table['e'].bits;
+  }
+};
+
+// Words of English text, drawn with a Zipf-like distribution
+std::string GenerateText(size_t size) {
+  const char *words[] = {
+    "the", "of", "and", "to", "a", "in", "is", "it", "you", "that", "he",
+    "was", "for", "on", "are", "with", "as", "his", "they", "be", "at",
+    "one", "have", "this", "from", "or", "had", "by", "word", "but", "what",
+    "some", "we", "can", "out", "other", "were", "all", "there", "when",
+    "up", "use", "your", "how", "said", "an", "each", "she", "which", "do",
+    "their", "time", "if", "will", "way", "about", "many", "then", "them",
+    "write", "would", "like", "so", "these", "her", "long", "make", "thing",
+    "see", "him", "two", "has", "look", "more", "day", "could", "go", "come",
+    "did", "number", "sound", "no", "most", "people", "my", "over", "know",
+    "water", "than", "call", "first", "who", "may", "down", "side", "been",
+  };
+  const size_t num_words = sizeof(words) / sizeof(words[0]);
+  std::vector<double> weights;
+  for (size_t i = 0; i < num_words; i++)
+    weights.push_back(1.0 / (i + 1));
+
+  std::mt19937 gen(42);
+  std::discrete_distribution<size_t> dist(weights.begin(), weights.end());
+  std::string text;
+  for (size_t i = 1; text.size() < size; i++) {
+    text += words[dist(gen)];
+    text += i % 12 ? ' ' : '\n';
+  }
+  text.resize(size);
+  return text;
+}
+
+// Skewed ASCII characters
+std::string GenerateSkewed(size_t size) {
+  std::mt19937 gen(42);
+  std::geometric_distribution<int> dist(0.08);
+
+  std::string skewed(size, 0);
+  for (char &c : skewed)
+    c = static_cast<char>(32 + dist(gen) % 95);
+  return skewed;
+}
+
+// Uniformly random bytes, which don't compress
+std::string GenerateRandom(size_t size) {
+  std::mt19937 gen(42);
+
+  std::string random(size, 0);
+  for (char &c : random)
+    c = static_cast<char>(gen());
+  return random;
+}
+
+void WriteFile(const std::string &filename, const std::string &contents) {
+  std::ofstream ofs(filename, std::ios::out |
+                    std::ios::trunc |
+                    std::ios::binary);
+  ofs.write(contents.data(), contents.size());
+}
+
+// Return the contents of filename
+std::string ReadFile(const std::string &filename) {
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  std::ostringstream contents;
+  contents << ifs.rdbuf();
+  return contents.str();
+}
+
+// Compress filename with the given options as zap does, mapping the input,
+// and return the seconds taken
+double TimeCompress(const std::string &filename,
+                    const std::string &zap_filename,
+                    const Huffman::CompressOptions &options) {
+  return TimeSeconds([&]() {
+    MappedFile mapped(filename.c_str());
+    if (options.threads == 1)
+      mapped.Advise(MADV_SEQUENTIAL);
+    std::ofstream ofs(zap_filename, std::ios::out |
+                      std::ios::trunc |
+                      std::ios::binary);
+    Huffman::Compress(mapped.data(), mapped.size(), ofs, options);
+  });
+}
+
+// Decompress zap_filename with the given options as unzap does, and return
+// the seconds taken
+double TimeDecompress(const std::string &zap_filename,
+                      const std::string &out_filename,
+                      const Huffman::DecompressOptions &options) {
+  return TimeSeconds([&]() {
+    MappedFile mapped(zap_filename.c_str());
+    if (options.threads == 1)
+      mapped.Advise(MADV_SEQUENTIAL);
+    std::ofstream ofs(out_filename, std::ios::out |
+                      std::ios::trunc |
+                      std::ios::binary);
+    Huffman::Decompress(mapped.data(), mapped.size(), ofs, options);
+  });
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = argc > 1 ? std::stoul(argv[1]) : 16 << 20;
+  std::string input{"bench_huffman_input"};
+  std::string zap{"bench_huffman_input.zap"};
+  std::string output{"bench_huffman_output"};
+
+  const struct {
+    const char *name;
+    std::string data;
+  } corpora[] = {
+    {"text", GenerateText(size)},
+    {"skewed", GenerateSkewed(size)},
+    {"random", GenerateRandom(size)},
+    {"run", std::string(size, 'a')},
+  };
+
+  ReportHeader();
+
+  // Byte counting is the first pass over the input, against the plain loop
+  const size_t repeat = 8;
+  auto count_simple = [](const char *data, size_t size, size_t *counts) {
+    for (size_t i = 0; i < size; i++)
+      counts[static_cast<unsigned char>(data[i])]++;
+  };
+  for (const auto &corpus : corpora) {
+    std::vector<size_t> counts(256, 0);
+    Report(std::string("histogram_simple_") + corpus.name, size * repeat,
+           "bytes", TimeSeconds([&]() {
+             for (size_t i = 0; i < repeat; i++)
+               count_simple(corpus.data.data(), size, counts.data());
+           }));
+    Report(std::string("histogram_") + corpus.name, size * repeat,
+           "bytes", TimeSeconds([&]() {
+             for (size_t i = 0; i < repeat; i++)
+               CountBytes(corpus.data.data(), size, counts.data());
+           }));
+    KeepAlive(counts[0]);
+  }
+
+  // Steps of the code construction of every block
+  const size_t num_builds = 10000;
+  for (const auto &corpus : corpora) {
+    std::vector<size_t> freq;
+    Report(std::string("count_input_freq_") + corpus.name, size, "bytes",
+           TimeSeconds([&]() {
+             freq = HuffmanBench::CountInputFreq(corpus.data);
+           }));
+
+    std::vector<uint8_t> lengths;
+    Report(std::string("build_tree_") + corpus.name, num_builds, "trees",
+           TimeSeconds([&]() {
+             for (size_t i = 0; i < num_builds; i++)
+               lengths = HuffmanBench::BuildTree(freq);
+           }));
+
+    uint32_t code = 0;
+    Report(std::string("build_table_") + corpus.name, num_builds, "tables",
+           TimeSeconds([&]() {
+             for (size_t i = 0; i < num_builds; i++)
+               code += HuffmanBench::BuildTable(lengths);
+           }));
+    KeepAlive(code);
+  }
+
+  // End to end, as zap and unzap
+  for (const auto &corpus : corpora) {
+    WriteFile(input, corpus.data);
+    Report(std::string("compress_") + corpus.name, size, "bytes",
+           TimeCompress(input, zap, Huffman::CompressOptions()));
+    Report(std::string("decompress_") + corpus.name, size, "bytes",
+           TimeDecompress(zap, output, Huffman::DecompressOptions()));
+
+    if (ReadFile(output) != corpus.data)
+      std::cerr << "Wrong output for " << corpus.name << std::endl;
+  }
+
+  // Many tiny files, where the headers and the code of every file count
+  const size_t num_tiny = 10000;
+  const std::string tiny = corpora[0].data.substr(0, 100);
+  WriteFile(input, tiny);
+  double seconds = 0;
+  for (size_t i = 0; i < num_tiny; i++)
+    seconds += TimeCompress(input, zap, Huffman::CompressOptions());
+  Report("compress_tiny", num_tiny * tiny.size(), "bytes", seconds);
+  seconds = 0;
+  for (size_t i = 0; i < num_tiny; i++)
+    seconds += TimeDecompress(zap, output, Huffman::DecompressOptions());
+  Report("decompress_tiny", num_tiny * tiny.size(), "bytes", seconds);
+  if (ReadFile(output) != tiny)
+    std::cerr << "Wrong output for tiny" << std::endl;
+
+  // The same messages in memory, then with the tables kept between messages.
+  // Without files, more of them are needed for steady times.
+  const size_t num_messages = 10 * num_tiny;
+  std::string coded, decoded;
+  Report("compress_buffer_tiny", num_messages * tiny.size(), "bytes",
+         TimeSeconds([&]() {
+           for (size_t i = 0; i < num_messages; i++)
+             Huffman::Compress(tiny.data(), tiny.size(), coded,
+                               Huffman::CompressOptions());
+         }));
+  Report("decompress_buffer_tiny", num_messages * tiny.size(), "bytes",
+         TimeSeconds([&]() {
+           for (size_t i = 0; i < num_messages; i++)
+             Huffman::Decompress(coded.data(), coded.size(), decoded,
+                                 Huffman::DecompressOptions());
+         }));
+  HuffmanEncoder encoder;
+  HuffmanDecoder decoder;
+  Report("encoder_tiny", num_messages * tiny.size(), "bytes",
+         TimeSeconds([&]() {
+           for (size_t i = 0; i < num_messages; i++)
+             encoder.Compress(tiny.data(), tiny.size(), coded);
+         }));
+  Report("decoder_tiny", num_messages * tiny.size(), "bytes",
+         TimeSeconds([&]() {
+           for (size_t i = 0; i < num_messages; i++)
+             decoder.Decompress(coded.data(), coded.size(), decoded);
+         }));
+  if (decoded != tiny)
+    std::cerr << "Wrong output for tiny in memory" << std::endl;
+
+  // With a table trained on other text, the messages hold no code lengths
+  const std::string &samples = corpora[0].data;
+  Huffman::SharedTable table = Huffman::TrainTable(
+      samples.data() + samples.size() / 2,
+      std::min<size_t>(samples.size() / 2, 1 << 16));
+  Huffman::CompressOptions shared_compress;
+  shared_compress.table = &table;
+  Huffman::DecompressOptions shared_decompress;
+  shared_decompress.table = &table;
+  HuffmanEncoder shared_encoder(shared_compress);
+  HuffmanDecoder shared_decoder(shared_decompress);
+  Report("encoder_tiny_shared", num_messages * tiny.size(), "bytes",
+         TimeSeconds([&]() {
+           for (size_t i = 0; i < num_messages; i++)
+             shared_encoder.Compress(tiny.data(), tiny.size(), coded);
+         }));
+  Report("decoder_tiny_shared", num_messages * tiny.size(), "bytes",
+         TimeSeconds([&]() {
+           for (size_t i = 0; i < num_messages; i++)
+             shared_decoder.Decompress(coded.data(), coded.size(), decoded);
+         }));
+  if (decoded != tiny)
+    std::cerr << "Wrong output for tiny with a shared table" << std::endl;
+
+  // The rest runs on the skewed corpus
+  const std::string &data = corpora[1].data;
+  WriteFile(input, data);
+
+  // Compression should scale with the threads, for the same output
+  size_t max_threads = std::max(4u, std::thread::hardware_concurrency());
+  std::string reference;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    Huffman::CompressOptions options;
+    options.threads = threads;
+    Report("compress_threads_" + std::to_string(threads), size, "bytes",
+           TimeCompress(input, zap, options));
+
+    std::string coded = ReadFile(zap);
+    if (reference.empty())
+      reference = coded;
+    else if (coded != reference)
+      std::cerr << "Output differs with " << threads << " threads"
+                << std::endl;
+  }
+
+  const struct {
+    const char *name;
+    Huffman::DecodeMethod method;
+  } decoders[] = {
+    {"decode_bitwise", Huffman::DecodeMethod::kBitwise},
+    {"decode_table", Huffman::DecodeMethod::kTable},
+  };
+  for (const auto &decoder : decoders) {
+    Huffman::DecompressOptions options;
+    options.method = decoder.method;
+    Report(decoder.name, size, "bytes", TimeDecompress(zap, output, options));
+  }
+
+  // Decompression should scale with the threads too, using the block index
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    Huffman::DecompressOptions options;
+    options.threads = threads;
+    Report("decompress_threads_" + std::to_string(threads), size, "bytes",
+           TimeDecompress(zap, output, options));
+
+    if (ReadFile(output) != data)
+      std::cerr << "Wrong output with " << threads << " threads" << std::endl;
+  }
+
+  // Interleaved streams let the table decoder work on four codes at once
+  Huffman::CompressOptions interleaved;
+  interleaved.interleaved = true;
+  Report("compress_interleaved", size, "bytes",
+         TimeCompress(input, zap, interleaved));
+  Report("decode_table_interleaved", size, "bytes",
+         TimeDecompress(zap, output, Huffman::DecompressOptions()));
+  if (ReadFile(output) != data)
+    std::cerr << "Wrong output with interleaved streams" << std::endl;
+
+  // With small blocks, building the code of every block takes most of the
+  // time
+  Huffman::CompressOptions small_blocks;
+  small_blocks.block_size = 4096;
+  Report("compress_block_4k", size, "bytes",
+         TimeCompress(input, zap, small_blocks));
+
+  // The adaptive code updates the tree after every character, in one pass
+  Report("compress_adaptive", size, "bytes", TimeSeconds([&]() {
+           std::ifstream ifs(input, std::ios::in | std::ios::binary);
+           std::ofstream ofs(zap, std::ios::out | std::ios::trunc |
+                             std::ios::binary);
+           Huffman::CompressAdaptive(ifs, ofs);
+         }));
+  Report("decompress_adaptive", size, "bytes",
+         TimeDecompress(zap, output, Huffman::DecompressOptions()));
+  if (ReadFile(output) != data)
+    std::cerr << "Wrong output with the adaptive code" << std::endl;
+
+  // Order-1 tables take one more lookup per character, and grouping the
+  // contexts adds to the code of every block. They pay on text, where the
+  // previous character tells much about the next.
+  const std::string &text = corpora[0].data;
+  WriteFile(input, text);
+  Huffman::CompressOptions context;
+  context.context_groups = 16;
+  Report("compress_context_text", size, "bytes",
+         TimeCompress(input, zap, context));
+  Report("decompress_context_text", size, "bytes",
+         TimeDecompress(zap, output, Huffman::DecompressOptions()));
+  if (ReadFile(output) != text)
+    std::cerr << "Wrong output with context tables" << std::endl;
+
+  std::remove(input.c_str());
+  std::remove(zap.c_str());
+  std::remove(output.c_str());
+  return 0;
+}
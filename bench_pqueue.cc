@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "pqueue.h"
+
+// Work item ordered through a pointer, as in MyClassPtrCompMin
+class Job {
+ public:
+  explicit Job(int priority) : priority_(priority) {}
+  bool operator < (const Job &job) const { return priority_ < job.priority_; }
+  bool operator > (const Job &job) const { return priority_ > job.priority_; }
+  int priority() const { return priority_; }
+ private:
+  int priority_;
+};
+
+// Push every item, then alternate a pop and a push for each item, then pop
+// them all, and return the seconds taken
+template <typename T, typename C, size_t D>
+double TimePushPop(const std::vector<T> &items) {
+  PQueue<T, C, D> pq;
+
+  return TimeSeconds([&]() {
+    for (const T &item : items)
+      pq.Push(item);
+    for (const T &item : items) {
+      pq.Pop();
+      pq.Push(item);
+    }
+    while (pq.Size())
+      pq.Pop();
+  });
+}
+
+// Report the operations of TimePushPop, each item is pushed and popped twice
+template <typename T, typename C, size_t D>
+void ReportPushPop(const std::string &name, const std::vector<T> &items) {
+  Report(name + "_arity_" + std::to_string(D), 4 * items.size(), "ops",
+         TimePushPop<T, C, D>(items));
+}
+
+// PQueue behind a single mutex, as callers share it today
+template <typename T, typename C>
+class LockedPQueue {
+ public:
+  void Push(const T &item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pq.Push(item);
+  }
+  bool TryPop(T &item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!pq.Size())
+      return false;
+    item = pq.PopTop();
+    return true;
+  }
+
+ private:
+  std::mutex mutex;
+  PQueue<T, C> pq;
+};
+
+// Split the items between threads that each push their share and pop as many
+// items, and return the seconds taken
+template <typename Q, typename T>
+double TimeConcurrent(Q &pq, const std::vector<T> &items, size_t threads) {
+  return TimeSeconds([&]() {
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < threads; t++) {
+      pool.emplace_back([&, t]() {
+        size_t first = items.size() * t / threads;
+        size_t last = items.size() * (t + 1) / threads;
+        T item;
+        for (size_t i = first; i < last; i++)
+          pq.Push(items[i]);
+        for (size_t i = first; i < last; i++) {
+          while (!pq.TryPop(item)) {}
+        }
+      });
+    }
+    for (auto &thread : pool)
+      thread.join();
+  });
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = argc > 1 ? std::stoul(argv[1]) : 1 << 20;
+
+  std::mt19937 gen(42);
+  std::vector<int> values(size);
+  std::vector<Job> jobs;
+  std::vector<Job*> pointers(size);
+  jobs.reserve(size);
+  for (size_t i = 0; i < size; i++) {
+    values[i] = gen();
+    jobs.emplace_back(values[i]);
+  }
+  // Jobs are reached in random order, as when allocated one by one
+  for (size_t i = 0; i < size; i++)
+    pointers[i] = &jobs[values[i] % size];
+
+  ReportHeader();
+
+  ReportPushPop<int, std::less<int>, 2>("pqueue_push_pop_value", values);
+  ReportPushPop<int, std::less<int>, 4>("pqueue_push_pop_value", values);
+  ReportPushPop<int, std::less<int>, 8>("pqueue_push_pop_value", values);
+
+  ReportPushPop<Job*, MyClassPtrCompMin<Job*>, 2>("pqueue_push_pop_pointer",
+                                                  pointers);
+  ReportPushPop<Job*, MyClassPtrCompMin<Job*>, 4>("pqueue_push_pop_pointer",
+                                                  pointers);
+  ReportPushPop<Job*, MyClassPtrCompMin<Job*>, 8>("pqueue_push_pop_pointer",
+                                                  pointers);
+
+  // Shared queues, each item is pushed and popped once
+  size_t max_threads = std::max(4u, std::thread::hardware_concurrency());
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    LockedPQueue<Job*, MyClassPtrCompMin<Job*>> locked;
+    Report("pqueue_locked_threads_" + std::to_string(threads), 2 * size,
+           "ops", TimeConcurrent(locked, pointers, threads));
+
+    ConcurrentPQueue<Job*, MyClassPtrCompMin<Job*>> concurrent;
+    Report("pqueue_concurrent_threads_" + std::to_string(threads), 2 * size,
+           "ops", TimeConcurrent(concurrent, pointers, threads));
+  }
+
+  return 0;
+}
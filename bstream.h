@@ -1,45 +1,127 @@
 #ifndef BSTREAM_H_
 #define BSTREAM_H_
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
 
 class BinaryInputStream {
  public:
-  explicit BinaryInputStream(std::ifstream &ifs);
+  explicit BinaryInputStream(std::istream &ifs);
+  // Read the size bytes at data directly, without copying them
+  BinaryInputStream(const char *data, size_t size);
 
   bool GetBit();
   char GetChar();
   int GetInt();
 
+  // Read the next n (at most 32) bits, first bit read is the most significant
+  uint32_t GetBits(size_t n);
+
+  // Look at the next n (at most 32) bits without consuming them.
+  // Missing bits past the end of the input read as 0s.
+  uint32_t PeekBits(size_t n);
+  // Skip n bits, usually after looking at them with PeekBits
+  void ConsumeBits(size_t n);
+
+  // Skip the bits left in the current byte
+  void AlignToByte();
+
+  // Read n whole bytes at once, the input must be at a byte boundary
+  void GetBytes(char *data, size_t n);
+
  private:
-  std::ifstream &ifs;
-  char buffer = 0;
+  // Bytes requested from the input stream at once. The stream may therefore
+  // be read ahead of the bits consumed so far.
+  static const size_t kBlockSize = 1 << 16;
+
+  std::istream *ifs = nullptr;
+  std::vector<char> block;
+  const char *next = nullptr;
+  const char *end = nullptr;
+
+  // Bits not consumed yet, aligned on the most significant bit
+  uint64_t buffer = 0;
   size_t avail = 0;
 
   // Helpers
-  void RefillBuffer();
+  bool FillBuffer(size_t n);
+  bool RefillBlock();
 };
 
-BinaryInputStream::BinaryInputStream(std::ifstream &ifs) : ifs(ifs) { }
+const size_t BinaryInputStream::kBlockSize;
 
-void BinaryInputStream::RefillBuffer() {
-  // Read the next byte from the input stream
-  ifs.get(buffer);
-  if (ifs.gcount() != 1)
-    throw std::underflow_error("No more characters to read");
-  avail = 8;
+BinaryInputStream::BinaryInputStream(std::istream &ifs) : ifs(&ifs) { }
+
+BinaryInputStream::BinaryInputStream(const char *data, size_t size)
+    : next(data), end(data + size) { }
+
+// Read the next block of bytes, return false at the end of the input stream
+bool BinaryInputStream::RefillBlock() {
+  // Input in memory is read in one block
+  if (!ifs)
+    return false;
+
+  if (block.empty())
+    block.resize(kBlockSize);
+
+  // Take the bytes already there, so that a live stream is read as it
+  // arrives, and wait for a byte only when there are none
+  std::streamsize size = ifs->readsome(block.data(), block.size());
+  if (size <= 0) {
+    ifs->read(block.data(), 1);
+    size = ifs->gcount();
+  }
+  next = block.data();
+  end = next + size;
+  return next != end;
+}
+
+// Make sure at least n bits are buffered, return false if the input ends first
+bool BinaryInputStream::FillBuffer(size_t n) {
+  if (avail >= n)
+    return true;
+
+  // With 8 bytes left in the block, load them at once as whole bytes are
+  // added below the buffered bits. The bits of the last bytes loaded are
+  // then in the buffer early, the next load adds the same bits again.
+  if (end - next >= 8) {
+    uint64_t word = 0;
+    for (size_t i = 0; i < 8; i++)
+      word = (word << 8) | static_cast<unsigned char>(next[i]);
+    buffer |= word >> avail;
+    next += (63 - avail) / 8;
+    avail |= 56;
+    return avail >= n;
+  }
+
+  // Top up the buffer byte by byte below the buffered bits
+  while (avail <= 56) {
+    if (next == end && !RefillBlock())
+      break;
+    buffer |= uint64_t(static_cast<unsigned char>(*next++)) << (56 - avail);
+    avail += 8;
+  }
+
+  return avail >= n;
 }
 
 bool BinaryInputStream::GetBit() {
   bool bit;
 
-  if (!avail)
-    RefillBuffer();
+  if (!FillBuffer(1))
+    throw std::underflow_error("No more characters to read");
 
+  bit = (buffer >> 63) == 1;
+  buffer <<= 1;
   avail--;
-  bit = ((buffer >> avail) & 1) == 1;
 
 #if 0  // Switch to 1 for debug purposes
   if (bit)
@@ -52,34 +134,74 @@ bool BinaryInputStream::GetBit() {
 }
 
 // Objective: This function reads character from the input stream and return it.
-// Concept: Read one bit at a time; char has 8 bits (1 byte).
-//          Left shift the character to create an empty bit to fill in.
-//          Read the bit using GetBit(), and store it using | operator.
+// Concept: char has 8 bits (1 byte), read them at once from the bit buffer.
 char BinaryInputStream::GetChar() {
-  char byte;
-
-  for (int i = 0; i < 8; i++)
-    byte = (byte << 1) | GetBit();
-
-  return byte;
+  return static_cast<char>(GetBits(8));
 }
 
 // Objective: This function reads integer from the input stream and return it
-// Concept: Read one bit at a time; int has 32 bits (4 bytes).
-//          Left shift the integer to create an empty bit to fill in.
-//          Read the bit using GetBit(), and store it using | operator.
+// Concept: int has 32 bits (4 bytes), read them at once from the bit buffer.
 int BinaryInputStream::GetInt() {
-  int word;
+  return static_cast<int>(GetBits(32));
+}
+
+uint32_t BinaryInputStream::GetBits(size_t n) {
+  uint32_t bits = PeekBits(n);
+  ConsumeBits(n);
+  return bits;
+}
 
-  for (int i = 0; i < 32; i++)
-    word = (word << 1) | GetBit();
+uint32_t BinaryInputStream::PeekBits(size_t n) {
+  if (!n)
+    return 0;
 
-  return word;
+  // Near the end of the input the bits below avail are already 0s
+  if (avail < n)
+    FillBuffer(n);
+  return static_cast<uint32_t>(buffer >> (64 - n));
+}
+
+void BinaryInputStream::ConsumeBits(size_t n) {
+  if (avail < n && !FillBuffer(n))
+    throw std::underflow_error("No more characters to read");
+  buffer = n < 64 ? buffer << n : 0;
+  avail -= n;
+}
+
+void BinaryInputStream::AlignToByte() {
+  // Whole bytes are buffered, so the bits of the current byte are the extra
+  // bits above a multiple of 8
+  ConsumeBits(avail % 8);
+}
+
+void BinaryInputStream::GetBytes(char *data, size_t n) {
+  if (avail % 8)
+    throw std::logic_error("Input not at a byte boundary");
+
+  // Bytes already buffered come first
+  for (; n && avail; n--)
+    *data++ = GetChar();
+  if (!n)
+    return;
+
+  // The buffer may hold bits of the bytes copied below
+  buffer = 0;
+
+  // Then copy the rest straight from the block
+  while (n) {
+    if (next == end && !RefillBlock())
+      throw std::underflow_error("No more characters to read");
+    size_t size = std::min<size_t>(n, end - next);
+    std::memcpy(data, next, size);
+    data += size;
+    next += size;
+    n -= size;
+  }
 }
 
 class BinaryOutputStream {
  public:
-  explicit BinaryOutputStream(std::ofstream &ofs);
+  explicit BinaryOutputStream(std::ostream &ofs);
   ~BinaryOutputStream();
 
   void Close();
@@ -88,16 +210,27 @@ class BinaryOutputStream {
   void PutChar(char byte);
   void PutInt(int word);
 
+  // Write the low nbits (at most 32) of value, most significant bit first
+  void PutBits(uint32_t value, size_t nbits);
+
+  // Pad the current byte with 0s
+  void AlignToByte();
+
+  // Write n whole bytes at once
+  void PutBytes(const char *data, size_t n);
+
  private:
-  std::ofstream &ofs;
-  char buffer = 0;
+  std::ostream &ofs;
+  // Bits not written yet, aligned on the least significant bit
+  uint64_t buffer = 0;
   size_t count = 0;
 
   // Helpers
+  void DrainBuffer();
   void FlushBuffer();
 };
 
-BinaryOutputStream::BinaryOutputStream(std::ofstream &ofs) : ofs(ofs) { }
+BinaryOutputStream::BinaryOutputStream(std::ostream &ofs) : ofs(ofs) { }
 
 BinaryOutputStream::~BinaryOutputStream() {
   Close();
@@ -107,52 +240,172 @@ void BinaryOutputStream::Close() {
   FlushBuffer();
 }
 
+// Hand every complete byte to the output stream buffer. Bytes are handed
+// over as soon as they are complete so that they reach the file even if the
+// output stream is closed first, the stream buffer writes them in blocks.
+void BinaryOutputStream::DrainBuffer() {
+  std::streambuf *sink = ofs.rdbuf();
+
+  while (count >= 8) {
+    count -= 8;
+    if (sink->sputc(static_cast<char>(buffer >> count)) ==
+        std::streambuf::traits_type::eof())
+      ofs.setstate(std::ios::badbit);
+  }
+}
+
 void BinaryOutputStream::FlushBuffer() {
+  DrainBuffer();
+
   // Nothing to flush
   if (!count)
     return;
 
   // If buffer isn't complete, pad with 0s before writing
-  if (count > 0)
-    buffer <<= (8 - count);
-
-  // Write to output stream
-  ofs.put(buffer);
+  buffer <<= (8 - count);
+  count = 8;
+  DrainBuffer();
 
   // Reset buffer
   buffer = 0;
-  count = 0;
 }
 
-void BinaryOutputStream::PutBit(bool bit) {
-  // Make some space and add bit to buffer
-  buffer <<= 1;
-  if (bit)
-    buffer |= 1;
+void BinaryOutputStream::AlignToByte() {
+  FlushBuffer();
+}
 
-  // If buffer is full, write it
-  if (++count == 8)
-    FlushBuffer();
+void BinaryOutputStream::PutBytes(const char *data, size_t n) {
+  // Out of the byte boundary, bytes go through the bit buffer
+  if (count) {
+    for (size_t i = 0; i < n; i++)
+      PutChar(data[i]);
+    return;
+  }
+
+  if (ofs.rdbuf()->sputn(data, n) != static_cast<std::streamsize>(n))
+    ofs.setstate(std::ios::badbit);
+}
+
+void BinaryOutputStream::PutBit(bool bit) {
+  PutBits(bit, 1);
 }
 
 // Objective: This function receives a character (byte)
 //            and store in output stream.
-// Concept: Read one bit at a time; char has 8 bits (1 byte).
-//          At each cycle, left shift 1 by i times so that 1 is at i-th bit.
-//          Using & operator, check if i-th bit of byte is 1 or 0, and store it.
+// Concept: char has 8 bits (1 byte), add them at once to the bit buffer.
 void BinaryOutputStream::PutChar(char byte) {
-  for (int i = 7; i >= 0; i--)
-    PutBit(byte & (1 << i));
+  PutBits(static_cast<unsigned char>(byte), 8);
 }
 
 // Objective: This function receives an integer (bytes)
 //            and store in output stream.
-// Concept: Read one bit at a time; int has 32 bits (4 bytes).
-//          At each cycle, left shift 1 by i times so that 1 is at i-th bit.
-//          Using & operator, check if i-th bit of byte is 1 or 0, and store it.
+// Concept: int has 32 bits (4 bytes), add them at once to the bit buffer.
 void BinaryOutputStream::PutInt(int word) {
-  for (int i = 31; i >= 0; i--)
-    PutBit(word & (1 << i));
+  PutBits(static_cast<uint32_t>(word), 32);
+}
+
+void BinaryOutputStream::PutBits(uint32_t value, size_t nbits) {
+  // Make some space and add the bits to buffer
+  buffer = (buffer << nbits) | (value & ((uint64_t(1) << nbits) - 1));
+  count += nbits;
+
+  // Write the bytes that are full
+  if (count >= 8)
+    DrainBuffer();
+}
+
+// Stream buffer appending to a string, e.g. to give BinaryOutputStream a
+// memory output. The string grows as needed, and a string reused for
+// outputs of similar sizes keeps its capacity so that it isn't allocated
+// again. It holds exactly the bytes written once synced or destroyed.
+class StringOutputBuffer : public std::streambuf {
+ public:
+  explicit StringOutputBuffer(std::string &out);
+  ~StringOutputBuffer();
+
+  // Number of bytes in the string, written ones included
+  size_t Size() const { return size + (pptr() - pbase()); }
+
+ protected:
+  int_type overflow(int_type c) override;
+  int sync() override;
+
+ private:
+  std::string &out;
+  // Bytes of out before the put area
+  size_t size;
+};
+
+StringOutputBuffer::StringOutputBuffer(std::string &out)
+    : out(out), size(out.size()) { }
+
+StringOutputBuffer::~StringOutputBuffer() {
+  sync();
+}
+
+// Objective: Make the put area the rest of the string, doubling the string
+//            first. Growing only when full keeps the cost of filling the new
+//            space in proportion to the bytes written.
+StringOutputBuffer::int_type StringOutputBuffer::overflow(int_type c) {
+  size = Size();
+  out.resize(std::max<size_t>(2 * out.size(), 256));
+  setp(&out[size], &out[0] + out.size());
+
+  if (traits_type::eq_int_type(c, traits_type::eof()))
+    return traits_type::not_eof(c);
+  *pptr() = traits_type::to_char_type(c);
+  pbump(1);
+  return c;
+}
+
+// Objective: Cut the string to the bytes written, the next byte grows it again
+int StringOutputBuffer::sync() {
+  size = Size();
+  out.resize(size);
+  setp(nullptr, nullptr);
+  return 0;
+}
+
+// Stream buffer passing on to os only the length bytes written from offset,
+// e.g. to cut a range out of an output that can only be written in full
+class RangeOutputBuffer : public std::streambuf {
+ public:
+  RangeOutputBuffer(std::ostream &os, uint64_t offset, uint64_t length);
+
+ protected:
+  int_type overflow(int_type c) override;
+  std::streamsize xsputn(const char *s, std::streamsize n) override;
+
+ private:
+  std::ostream &os;
+  // Bytes to drop before the range, and left to pass on
+  uint64_t skip;
+  uint64_t left;
+};
+
+RangeOutputBuffer::RangeOutputBuffer(std::ostream &os, uint64_t offset,
+                                     uint64_t length)
+    : os(os), skip(offset), left(length) { }
+
+RangeOutputBuffer::int_type RangeOutputBuffer::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof()))
+    return traits_type::not_eof(c);
+  char ch = traits_type::to_char_type(c);
+  xsputn(&ch, 1);
+  return c;
+}
+
+// Objective: Drop the bytes before the range and after it, write the rest
+std::streamsize RangeOutputBuffer::xsputn(const char *s, std::streamsize n) {
+  uint64_t size = static_cast<uint64_t>(n);
+  uint64_t dropped = std::min(skip, size);
+  skip -= dropped;
+
+  uint64_t kept = std::min(left, size - dropped);
+  if (kept)
+    os.write(s + dropped, kept);
+  left -= kept;
+  return n;
 }
 
 #endif  // BSTREAM_H_
@@ -0,0 +1,82 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Number of sub-histograms counted in turn. Consecutive equal bytes then
+// increment different counters, so an increment doesn't wait for the store
+// of the previous one to the same counter.
+const size_t kHistogramTables = 4;
+
+// Inputs below this size are counted directly, clearing and adding up the
+// sub-histograms would cost more than it saves
+const size_t kHistogramMinSize = 1024;
+
+// Bytes counted into the 32-bit sub-histograms before adding them to the
+// totals, so that they can't overflow
+const size_t kHistogramChunkSize = size_t(1) << 30;
+
+// Add the number of times each byte value appears in the size bytes at data
+// to counts, which has 256 entries
+void CountBytes(const char *data, size_t size, size_t *counts);
+
+// Objective: Count the bytes of data into interleaved sub-histograms
+// Concept: Bytes are loaded eight at a time as one 64-bit word, and each
+//          byte of the word goes to the next sub-histogram. The order of the
+//          bytes in the word doesn't matter to the counts.
+void CountBytes(const char *data, size_t size, size_t *counts) {
+  const unsigned char *next = reinterpret_cast<const unsigned char *>(data);
+  const unsigned char *end = next + size;
+
+  if (size < kHistogramMinSize) {
+    while (next != end)
+      counts[*next++]++;
+    return;
+  }
+
+  while (next != end) {
+    uint32_t tables[kHistogramTables][256];
+    std::memset(tables, 0, sizeof(tables));
+
+    const unsigned char *chunk_end =
+        next + std::min<size_t>(end - next, kHistogramChunkSize);
+    while (chunk_end - next >= 16) {
+      uint64_t low, high;
+      std::memcpy(&low, next, 8);
+      std::memcpy(&high, next + 8, 8);
+      next += 16;
+
+      tables[0][low & 0xff]++;
+      tables[1][(low >> 8) & 0xff]++;
+      tables[2][(low >> 16) & 0xff]++;
+      tables[3][(low >> 24) & 0xff]++;
+      tables[0][(low >> 32) & 0xff]++;
+      tables[1][(low >> 40) & 0xff]++;
+      tables[2][(low >> 48) & 0xff]++;
+      tables[3][low >> 56]++;
+      tables[0][high & 0xff]++;
+      tables[1][(high >> 8) & 0xff]++;
+      tables[2][(high >> 16) & 0xff]++;
+      tables[3][(high >> 24) & 0xff]++;
+      tables[0][(high >> 32) & 0xff]++;
+      tables[1][(high >> 40) & 0xff]++;
+      tables[2][(high >> 48) & 0xff]++;
+      tables[3][high >> 56]++;
+    }
+    while (next != chunk_end)
+      tables[0][*next++]++;
+
+    // Add up the sub-histograms
+    for (size_t i = 0; i < 256; i++) {
+      size_t count = 0;
+      for (size_t table = 0; table < kHistogramTables; table++)
+        count += tables[table][i];
+      counts[i] += count;
+    }
+  }
+}
+
+#endif  // HISTOGRAM_H_
@@ -1,30 +1,46 @@
 #ifndef HUFFMAN_H_
 #define HUFFMAN_H_
 
+#include <sys/resource.h>
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <utility>
 #include <cstddef>
+#include <cstdint>
 #include <cctype>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 
+#include "adaptive_huffman.h"
 #include "bstream.h"
-#include "pqueue.h"
+#include "histogram.h"
 
+// Node of a HuffmanTree, its children are given by their index in the tree
 class HuffmanNode {
  public:
+  // Index of the children of a leaf
+  static const uint16_t kNoChild = 0xffff;
+
   explicit HuffmanNode(char ch, size_t freq,
-                       HuffmanNode *left = nullptr,
-                       HuffmanNode *right = nullptr)
+                       uint16_t left = kNoChild,
+                       uint16_t right = kNoChild)
       : ch_(ch), freq_(freq), left_(left), right_(right) { }
 
 
   bool IsLeaf() {
     // Node is a leaf if it doesn't have any children
-    return left_ == nullptr && right_ == nullptr;
+    return left_ == kNoChild && right_ == kNoChild;
   }
 
   bool operator < (const HuffmanNode &n) const {
@@ -38,134 +54,1179 @@ class HuffmanNode {
 
   size_t freq() { return freq_; }
   size_t data() { return ch_; }
-  HuffmanNode* left() { return left_; }
-  HuffmanNode* right() { return right_; }
+  uint16_t left() { return left_; }
+  uint16_t right() { return right_; }
 
  private:
   char ch_;
   size_t freq_;
-  HuffmanNode *left_, *right_;
+  uint16_t left_, right_;
+};
+
+const uint16_t HuffmanNode::kNoChild;
+
+// Huffman tree with all its nodes in one array, allocated once for the
+// largest tree and freed with the tree. The root is the last node added.
+class HuffmanTree {
+ public:
+  // A tree over the 256 byte values has at most 511 nodes
+  static const size_t kMaxNodes = 2 * 256 - 1;
+
+  HuffmanTree() { nodes.reserve(kMaxNodes); }
+
+  // Add a node and return its index. Nodes don't move once added.
+  uint16_t AddNode(const HuffmanNode &node);
+
+  // Remove every node, keeping the memory for the next tree
+  void Clear() { nodes.clear(); }
+
+  size_t Size() { return nodes.size(); }
+  bool Empty() { return nodes.empty(); }
+  HuffmanNode& Node(uint16_t index) { return nodes[index]; }
+  uint16_t Root() { return nodes.size() - 1; }
+
+ private:
+  std::vector<HuffmanNode> nodes;
 };
 
+const size_t HuffmanTree::kMaxNodes;
+
+uint16_t HuffmanTree::AddNode(const HuffmanNode &node) {
+  // Corrupted trees could grow further
+  if (nodes.size() == kMaxNodes)
+    throw std::runtime_error("Too many nodes in huffman tree");
+
+  nodes.push_back(node);
+  return nodes.size() - 1;
+}
+
 class Huffman {
  public:
+  // Decoders available to Decompress, bit by bit decoding is kept as a
+  // reference
+  enum class DecodeMethod { kTable, kBitwise };
+
+  // Limits of the max_code_length of Compress. Codes of 8 bits are enough
+  // for every byte value, and the coding table holds codes up to 32 bits.
+  static const size_t kMinCodeLengthLimit = 8;
+  static const size_t kMaxCodeLength = 32;
+
+  // Limit of the block_size of Compress, so that the number of characters
+  // of a block fits in 32 bits
+  static const size_t kDefaultBlockSize = 1 << 20;
+  static const size_t kMaxBlockSize = size_t(1) << 30;
+
+  // Limit of the context_groups of Compress, a table per previous character
+  static const size_t kMaxContextGroups = 256;
+
+  // Number of block types of the zap format, and the name of each
+  static const size_t kNumBlockTypes = 7;
+  static const char *BlockTypeName(size_t type);
+
+  // Measures of a call to Compress or Decompress, filled when the options
+  // point to them. The seconds of each phase are added up over the blocks,
+  // with several threads they may add up to more than total_seconds.
+  struct Stats {
+    double total_seconds = 0;
+    // Reading the input, with a mapped input it happens in histogram instead
+    double read_seconds = 0;
+    double histogram_seconds = 0;
+    // Code lengths, from the tree or package-merge
+    double tree_seconds = 0;
+    // Coding table of Compress, decoding table of Decompress
+    double table_seconds = 0;
+    double encode_seconds = 0;
+    // When decoding through streams, reads and writes happen in decode
+    double decode_seconds = 0;
+    double write_seconds = 0;
+
+    // Decompress leaves bytes_in at 0 if its input stream can't be measured,
+    // e.g. a pipe
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t symbols = 0;
+
+    // Blocks written or read of each type, indexed by the type byte
+    uint64_t blocks[kNumBlockTypes] = {};
+
+    // Shannon entropy of the characters of each block and bits of their
+    // codes, added up over the blocks. Only filled by Compress.
+    double entropy_bits = 0;
+    uint64_t coded_bits = 0;
+
+    // Peak resident memory of the process
+    size_t peak_memory = 0;
+  };
+
+  // Write the stats as text, one measure per line, or as a JSON object
+  static void PrintStats(const Stats &stats, std::ostream &os);
+  static void PrintStatsJson(const Stats &stats, std::ostream &os);
+
+  // Code trained on sample inputs, given to both Compress and Decompress.
+  // Blocks coded with it refer to it by its id instead of holding their
+  // code lengths, which for small inputs take more than the codes save.
+  struct SharedTable {
+    // Hash of the lengths, so that a different table is detected
+    uint32_t id = 0;
+    // Code length of every byte value
+    std::vector<uint8_t> lengths;
+  };
+
+  // Train a table on the size bytes of samples at data. Every byte value
+  // gets a code, those missing from the samples the longest ones.
+  static SharedTable TrainTable(const char *data, size_t size,
+                                size_t max_code_length = kMaxCodeLength);
+
+  // Write the table to a table file, or read it back from the size bytes
+  // at data
+  static void WriteTable(const SharedTable &table, std::ostream &os);
+  static SharedTable ReadTable(const char *data, size_t size);
+
+  // Settings of Compress
+  struct CompressOptions {
+    // Codes longer than this are avoided at a small cost in size,
+    // a limit within the decoding table makes decoding faster
+    size_t max_code_length = kMaxCodeLength;
+    // Number of input bytes coded with the same table, only one block of
+    // input per thread is kept in memory at once
+    size_t block_size = kDefaultBlockSize;
+    // Number of blocks coded at once, the output doesn't depend on it
+    size_t threads = 1;
+    // Split the characters of every block into kInterleavedStreams streams
+    // that are decoded side by side, at a cost of a few bytes per block
+    bool interleaved = false;
+    // Code blocks with this table when it is shorter than their own code,
+    // the zap file then needs the same table to be decompressed
+    const SharedTable *table = nullptr;
+    // Code every character with one of up to this many tables, chosen by
+    // the character before it, in blocks where it is shorter than a single
+    // table. Such blocks aren't interleaved.
+    size_t context_groups = 1;
+    // Where to add the measures of the call, nothing is measured without
+    Stats *stats = nullptr;
+  };
+
   static void Compress(std::ifstream &ifs, std::ofstream &ofs);
+  static void Compress(std::ifstream &ifs, std::ofstream &ofs,
+                       const CompressOptions &options);
+  // Compress the size bytes at data, e.g. a memory-mapped file, in place
+  static void Compress(const char *data, size_t size, std::ostream &os,
+                       const CompressOptions &options);
+  // Compress into out, replacing its contents. A string reused between
+  // calls keeps its memory; see HuffmanEncoder to keep the tables too.
+  static void Compress(const char *data, size_t size, std::string &out,
+                       const CompressOptions &options);
+
+  // Settings of Decompress
+  struct DecompressOptions {
+    DecodeMethod method = DecodeMethod::kTable;
+    // Number of blocks decoded at once, with the block index of the file
+    size_t threads = 1;
+    // Table of the blocks coded with a shared table, if any
+    const SharedTable *table = nullptr;
+    // Where to add the measures of the call, nothing is measured without
+    Stats *stats = nullptr;
+  };
 
-  static void Decompress(std::ifstream &ifs, std::ofstream &ofs);
+  static void Decompress(std::ifstream &ifs, std::ofstream &ofs,
+                         DecodeMethod method = DecodeMethod::kTable);
+  static void Decompress(std::ifstream &ifs, std::ofstream &ofs,
+                         const DecompressOptions &options);
+  // Decompress the zap file of size bytes at data, e.g. memory-mapped
+  static void Decompress(const char *data, size_t size, std::ostream &os,
+                         const DecompressOptions &options);
+  // Decompress into out, replacing its contents
+  static void Decompress(const char *data, size_t size, std::string &out,
+                         const DecompressOptions &options);
+
+  // Write length characters of the original input starting at offset,
+  // decoding only the blocks that hold them. The range is cut at the end of
+  // the input. Files without a block index, or read from a pipe, are
+  // decoded from the start instead.
+  static void DecompressRange(std::ifstream &ifs, std::ofstream &ofs,
+                              uint64_t offset, uint64_t length);
+  static void DecompressRange(std::ifstream &ifs, std::ofstream &ofs,
+                              uint64_t offset, uint64_t length,
+                              const DecompressOptions &options);
+  static void DecompressRange(const char *data, size_t size,
+                              std::ostream &os,
+                              uint64_t offset, uint64_t length,
+                              const DecompressOptions &options);
+
+  // Compress the input in one pass with an adaptive code, e.g. a live
+  // stream: the characters read are coded and written before the next read,
+  // in constant memory. See AdaptiveHuffmanEncoder to give the characters.
+  static void CompressAdaptive(std::istream &is, std::ostream &os);
 
  private:
-  // Count the frequency of each character in the input file
-  static std::vector<size_t> CountInputFreq(std::ifstream &ifs,
-                                            std::vector<char> &vec_input_file);
+  // Times the steps of Compress on their own
+  friend class HuffmanBench;
+  // Checks the steps and the blocks of Compress
+  friend class HuffmanTest;
+  // Code messages with the steps of Compress and Decompress, keeping their
+  // tables between messages
+  friend class HuffmanEncoder;
+  friend class HuffmanDecoder;
+  friend class AdaptiveHuffmanEncoder;
+  friend class AdaptiveHuffmanDecoder;
+
+  // Every zap file starts with the magic bytes "ZAP" and a format version.
+  // Files without them are from before the format was versioned and start
+  // directly with the preorder tree.
+  static const uint32_t kMagic = 0x5a4150;
+  static const uint8_t kFormatVersion = 8;
+  static const size_t kHeaderSize = 4;
+
+  // After the header, the input is split into blocks which each start with
+  // their type, and end on a byte boundary. The last block has type kBlockEnd.
+  static const uint8_t kBlockHuffman = 0;
+  static const uint8_t kBlockEnd = 0xff;
+
+  // Since version 4, blocks of type kBlockHuffmanInterleaved hold their
+  // characters in kInterleavedStreams streams, character i in stream
+  // i % kInterleavedStreams. After the number of characters, the streams
+  // start on a byte boundary with the size in bytes of each (32 bits).
+  static const uint8_t kBlockHuffmanInterleaved = 1;
+  static const size_t kInterleavedStreams = 4;
+
+  // Since version 5, blocks of type kBlockShared and kBlockSharedInterleaved
+  // are coded with a SharedTable. Their type is followed by the id of the
+  // table (32 bits) instead of the code lengths, then they are laid out as
+  // kBlockHuffman and kBlockHuffmanInterleaved.
+  static const uint8_t kBlockShared = 2;
+  static const uint8_t kBlockSharedInterleaved = 3;
+
+  // Since version 6, a block of type kBlockAdaptive holds characters coded
+  // with an AdaptiveHuffmanTree, up to its end symbol. It is the only block
+  // of its file, and isn't in the index since its size isn't known ahead.
+  static const uint8_t kBlockAdaptive = 4;
+
+  // Bytes read at most at once by CompressAdaptive
+  static const size_t kAdaptiveReadSize = 1 << 16;
+
+  // Since version 7, blocks of type kBlockContext code every character with
+  // the table of the group of the character before it, the first one with
+  // the group of character 0. The type is followed by the number of groups
+  // minus one (8 bits), the group of every character in the bits of that
+  // number (at least 1), and the code lengths of every group. Then the
+  // block is laid out as kBlockHuffman.
+  static const uint8_t kBlockContext = 5;
+
+  // Rounds of regrouping of the contexts of a block
+  static const size_t kContextIterations = 4;
+
+  // Since version 8, blocks of type kBlockStored hold their characters
+  // as they are, after their number (32 bits). Blocks are stored when their
+  // code wouldn't make them shorter.
+  static const uint8_t kBlockStored = 6;
+
+  // Bytes copied at once from stored blocks
+  static const size_t kStoredCopySize = 1 << 16;
+
+  // Table files start with the magic bytes "ZTB" and their version, then
+  // hold the id of the table (32 bits) and its code lengths
+  static const uint32_t kTableMagic = 0x5a5442;
+  static const uint8_t kTableVersion = 1;
+
+  // Since version 3, the end block is followed by the block index: the
+  // offset (64 bits) and the number of characters (32 bits) of every block,
+  // then the number of blocks (32 bits) and the magic bytes "ZIDX". Files
+  // of a single block, which are decoded from the start anyway, have none.
+  static const uint32_t kIndexMagic = 0x5a494458;
+  static const size_t kIndexEntrySize = 12;
+  static const size_t kIndexTrailerSize = 8;
+
+  // Offset of a block from the start of the zap file, and its number of
+  // characters once decoded
+  struct BlockIndexEntry {
+    uint64_t offset;
+    uint32_t size;
+  };
+
+  // Bytes of a block in memory
+  struct BlockData {
+    const char *data;
+    size_t size;
+  };
+
+  // Code of a character, the low length bits of bits are written MSB first
+  struct HuffmanCode {
+    uint32_t bits;
+    uint8_t length;
+  };
+
+  // Number of bits resolved by one probe of the decoding table
+  static const size_t kDecodeTableBits = 11;
+
+  // Entry of the decoding table, indexed by the next table_bits bits of the
+  // input. Codes longer than the table have a length above table_bits.
+  struct DecodeEntry {
+    uint8_t symbol;
+    uint8_t length;
+  };
+
+  // Adds the time between laps to the phases of stats, and does nothing if
+  // there are no stats
+  class PhaseTimer {
+   public:
+    explicit PhaseTimer(Stats *stats);
+
+    // Add the time since the previous lap to the phase
+    void Lap(double Stats::*phase);
+
+    // Add the time since the previous lap to the total time, and record the
+    // peak memory
+    void Finish();
+
+   private:
+    Stats *stats;
+    std::chrono::steady_clock::time_point last;
+  };
+
+  // Add the measures of from to to
+  static void AddStats(const Stats &from, Stats &to);
+
+  // Return the size of the stream from start, or 0 if it can't be measured
+  static uint64_t StreamSize(std::ifstream &ifs, std::streampos start);
+
+  // Decoding tables of a canonical code
+  struct DecodeTable {
+    size_t table_bits;
+    std::vector<DecodeEntry> entries;
+
+    // For bit by bit decoding, the codes of each length are consecutive
+    // numbers starting at first_code, for the characters of sorted_symbols
+    // starting at first_index
+    size_t max_length;
+    uint64_t first_code[kMaxCodeLength + 1];
+    size_t first_index[kMaxCodeLength + 1];
+    size_t count[kMaxCodeLength + 1];
+    std::vector<uint8_t> sorted_symbols;
+  };
+
+  // Read the next block of the input file, return false at its end
+  static bool ReadBlock(std::ifstream &ifs, size_t block_size,
+                        std::vector<char> &vec_input_file);
+
+  // Item of a list of package-merge: its weight, and its character or -1
+  // for a package
+  struct PackageItem {
+    uint64_t weight;
+    int symbol;
+  };
+
+  // Lists of LimitCodeLengths, kept between calls
+  struct PackageMergeLists {
+    // Characters sorted by frequency
+    std::vector<size_t> symbols;
+    // lists[0] holds the coins of the longest length
+    std::vector<std::vector<PackageItem>> lists;
+  };
+
+  // Tables used to code a block, kept between blocks so that their memory
+  // is allocated once
+  struct BlockEncodeTables {
+    std::vector<size_t> freq;
+    HuffmanTree tree;
+    std::vector<uint8_t> lengths;
+    std::vector<HuffmanCode> code_table;
+
+    // Counts of every character after every character, the group of every
+    // context, and the counts, code lengths and codes of the groups, one
+    // row of 256 per group
+    std::vector<uint32_t> context_freq;
+    std::vector<uint8_t> context_group;
+    std::vector<size_t> group_freq;
+    std::vector<double> group_cost;
+    std::vector<uint8_t> group_lengths;
+    std::vector<HuffmanCode> group_codes;
+    // Row of group_freq and group_lengths being coded
+    std::vector<size_t> row_freq;
+    std::vector<uint8_t> row_lengths;
 
-  // Build the huffman tree
-  static PQueue<HuffmanNode*, MyClassPtrCompMin<HuffmanNode*>>
-                                         BuildTree(std::vector<size_t>& input);
+    PackageMergeLists package_merge;
+    // Characters of each interleaved stream, once coded
+    std::string streams[kInterleavedStreams];
+  };
 
-  // Output the huffman tree
-  static void OutputTree(PQueue<HuffmanNode*,
-                         MyClassPtrCompMin<HuffmanNode*>>& pq,
-                         BinaryOutputStream& output);
+  // Tables used to decode a block, kept between blocks too
+  struct BlockDecodeTables {
+    std::vector<uint8_t> lengths;
+    DecodeTable table;
+    // Shared table of the blocks that use one, and whether table was built
+    // from it, so that it is built once for all of them
+    const SharedTable *shared = nullptr;
+    bool table_is_shared = false;
+    // Group of every context and tables of the groups of context blocks
+    std::vector<uint8_t> context_group;
+    std::vector<DecodeTable> group_tables;
+    // Bytes of stored blocks on their way to the output
+    std::vector<char> stored;
+    // Coded streams of interleaved blocks, and their decoded characters
+    std::vector<char> streams;
+    std::vector<char> decoded;
+  };
 
-  // Preorder recursive method
-  static void PreOrder(HuffmanNode& n, BinaryOutputStream& output);
+  // Count the frequency of each character in the block
+  static void CountInputFreq(const char *data, size_t size,
+                             std::vector<size_t>& freq);
+
+  // Build the huffman tree into tree
+  static void BuildTree(std::vector<size_t>& input, HuffmanTree& tree);
+
+  // Call fn(i) for every i below count from up to threads threads
+  template <typename F>
+  static void ParallelFor(size_t count, size_t threads, F fn);
+
+  // Throw if the options are out of range
+  static void CheckOptions(const CompressOptions &options);
+
+  // Write one block of input as a kBlockHuffman block with the tables,
+  // measured into stats if any
+  static void CompressBlock(const char *data, size_t size,
+                            const CompressOptions &options,
+                            BinaryOutputStream& output,
+                            BlockEncodeTables& tables, Stats *stats);
+
+  // Code the blocks at once and write them in order, adding them to the
+  // index. offset is the position of the next block in the zap file.
+  static void CompressBlocks(std::vector<BlockData>& blocks,
+                             const CompressOptions &options,
+                             std::vector<std::string>& coded_blocks,
+                             std::vector<BlockIndexEntry>& index,
+                             uint64_t& offset, std::ostream &os);
+
+  // Get the code length of each character from the tree
+  static void CodeLengths(HuffmanTree& tree, std::vector<uint8_t>& lengths);
+
+  // Helper method
+  static void HelperCodeLengths(HuffmanTree& tree, uint16_t n,
+                                std::vector<uint8_t>& lengths, size_t length);
+
+  // Return the id of the table with these lengths
+  static uint32_t TableId(const std::vector<uint8_t>& lengths);
+
+  // Return true if the characters of freq are coded in fewer bits with the
+  // shared table than with lengths, counting the code lengths written, and
+  // the codes of the table are within max_code_length
+  static bool UseSharedTable(std::vector<size_t>& freq,
+                             std::vector<uint8_t>& lengths,
+                             const SharedTable& table,
+                             size_t max_code_length);
+
+  // Return the number of bits written by OutputLengths
+  static size_t LengthsBits(std::vector<uint8_t>& lengths);
+
+  // Get optimal code lengths no longer than max_length (package-merge)
+  static void LimitCodeLengths(const std::vector<size_t>& input,
+                               size_t max_length,
+                               std::vector<uint8_t>& lengths,
+                               PackageMergeLists& package_merge);
+
+  // Output the magic bytes and the format version
+  static void OutputHeader(BinaryOutputStream& output);
+
+  // Output the code lengths
+  static void OutputLengths(const std::vector<uint8_t>& lengths,
+                            BinaryOutputStream& output);
 
   // Output the number of encoded characeters
   static void OutputNumChar(std::vector<size_t>& input,
                             BinaryOutputStream& output);
 
   // Build the coding table
-  static std::vector<std::string> BuildTable(HuffmanNode& n);
-
-  // Helper method
-  static void HelperBuildTable(HuffmanNode& n,
-                               std::vector<std::string>& code_table,
-                               std::vector<char>& encoding);
+  static void BuildTable(const std::vector<uint8_t>& lengths,
+                         std::vector<HuffmanCode>& code_table);
 
   // Output the sequence of encoded characters
-  static void OutputChar(std::vector<std::string>& code_table,
+  static void OutputChar(std::vector<HuffmanCode>& code_table,
                          BinaryOutputStream& output,
-                         std::vector<char>& vec_input_file);
+                         const char *data, size_t size);
+
+  // Output the characters encoded with the code table of tables, split
+  // into interleaved streams
+  static void OutputInterleaved(BlockEncodeTables& tables,
+                                BinaryOutputStream& output,
+                                const char *data, size_t size);
+
+  // Return the bits of the characters of the counts at their entropy
+  static double EntropyBits(const std::vector<size_t>& freq, size_t size);
+
+  // Return the fewest bits any code of the block could take with its
+  // tables, from its counts and its context counts if contexts are used
+  static double MinCodedBits(const BlockEncodeTables& tables, size_t size,
+                             const CompressOptions &options);
+
+  // Add the measures of a stored block to stats
+  static void AddStoredStats(const std::vector<size_t>& freq, size_t size,
+                             Stats &stats);
+
+  // Output the characters of a stored block
+  static void OutputStored(BinaryOutputStream& output,
+                           const char *data, size_t size);
+
+  // Count the characters after every character, the first one after 0
+  static void CountContextFreq(const char *data, size_t size,
+                               std::vector<uint32_t>& context_freq);
+
+  // Group the contexts of the context counts into up to max_groups groups,
+  // and count the characters of every group. Return the number of groups.
+  static size_t GroupContexts(BlockEncodeTables& tables, size_t max_groups);
+
+  // Build the codes of the groups of contexts from the context counts of
+  // the block, return the bits of its tables and characters coded with them
+  static size_t BuildContextTables(const CompressOptions &options,
+                                   BlockEncodeTables& tables);
+
+  // Bits of the group numbers of a context block
+  static size_t ContextGroupBits(size_t num_groups);
+
+  // Output the groups of the contexts and their code lengths
+  static void OutputContextTables(BlockEncodeTables& tables,
+                                  BinaryOutputStream& output);
+
+  // Output the characters coded with the table of their context
+  static void OutputContextChar(const BlockEncodeTables& tables,
+                                BinaryOutputStream& output,
+                                const char *data, size_t size);
+
+  // Read the code lengths
+  static void ReadLengths(BinaryInputStream& input,
+                          std::vector<uint8_t>& lengths);
+
+  // Build the decoding tables from the code lengths
+  static void BuildDecodeTable(std::vector<uint8_t>& lengths,
+                               DecodeTable& table);
+
+  // Read one character one bit at a time
+  static uint8_t DecodeBitwise(const DecodeTable& table,
+                               BinaryInputStream& input);
+
+  // Read one character using the decoding tables
+  static uint8_t DecodeSymbol(const DecodeTable& table,
+                              BinaryInputStream& input);
 
-  // Recreate the tree from the binary input
-  static HuffmanNode* ReBuildTree(BinaryInputStream& input_stream);
+  // Read the characters using the decoding tables, return their number
+  static uint32_t DecodeString(const DecodeTable& table, DecodeMethod method,
+                               BinaryInputStream& input,
+                               BinaryOutputStream& output);
 
-  // Read the characters from the encoded binary strings
-  static void ReEncodeString(PQueue<HuffmanNode*,
-                             MyClassPtrCompMin<HuffmanNode*>> &pq,
-                             BinaryInputStream& input,
-                             BinaryOutputStream& output);
+  // Read the characters from interleaved streams, one character of each
+  // stream in turn, return their number
+  static uint32_t DecodeInterleaved(BlockDecodeTables& tables,
+                                    DecodeMethod method,
+                                    BinaryInputStream& input,
+                                    BinaryOutputStream& output);
+
+  // Read the groups of the contexts and build the tables of the groups
+  static void ReadContextTables(BinaryInputStream& input,
+                                BlockDecodeTables& tables);
+
+  // Read the characters of a context block, return their number
+  static uint32_t DecodeContext(const BlockDecodeTables& tables,
+                                DecodeMethod method,
+                                BinaryInputStream& input,
+                                BinaryOutputStream& output);
+
+  // Copy the characters of a stored block, return their number
+  static uint32_t CopyStored(BinaryInputStream& input,
+                             BinaryOutputStream& output,
+                             BlockDecodeTables& tables);
+
+  // Read the characters of an adaptive block, return their number
+  static uint64_t DecodeAdaptive(BinaryInputStream& input,
+                                 BinaryOutputStream& output);
+
+  // Read the code lengths and the characters of a block of the given type
+  // with the tables, measured into stats if any. Return the number of
+  // characters.
+  static uint64_t DecompressBlock(uint8_t type, DecodeMethod method,
+                                  BinaryInputStream& input,
+                                  BinaryOutputStream& output,
+                                  BlockDecodeTables& tables, Stats *stats);
+
+  // Output the block index
+  static size_t IndexSize(const std::vector<BlockIndexEntry>& index);
+  static void OutputIndex(std::vector<BlockIndexEntry>& index,
+                          BinaryOutputStream& output);
+
+  // Check the number of blocks in the trailer of a zap file of file_size
+  // bytes, and find where the blocks end. Return false if it has no index.
+  static bool ReadTrailer(const char *trailer, uint64_t file_size,
+                          uint64_t& num_blocks, uint64_t& blocks_end);
+
+  // Read the num_blocks entries of the index at data
+  static void ParseIndex(const char *data, uint64_t num_blocks,
+                         uint64_t blocks_end,
+                         std::vector<BlockIndexEntry>& index);
+
+  // Read the block index of the zap file starting at start. The last entry
+  // is the end of the blocks. Return false if the file doesn't have one.
+  static bool ReadIndex(std::ifstream &ifs, std::streampos start,
+                        std::vector<BlockIndexEntry>& index);
+  static bool ReadIndex(const char *data, size_t size,
+                        std::vector<BlockIndexEntry>& index);
+
+  // Find the block holding the character at offset, and the offset of its
+  // first character
+  static size_t FindBlock(std::vector<BlockIndexEntry>& index,
+                          uint64_t offset, uint64_t& block_offset);
+
+  // Decode the blocks at once and write them in order, leaving out the first
+  // skip characters and those after length. entries are their index entries.
+  static void DecompressBlocks(std::vector<BlockData>& blocks,
+                               const BlockIndexEntry *entries,
+                               const DecompressOptions &options,
+                               std::vector<std::string>& decoded_blocks,
+                               uint64_t& skip, uint64_t& length,
+                               std::ostream &os);
+
+  // Decode the blocks first to last of the index from up to threads
+  // threads, leaving out the first skip characters and those after length
+  static void DecompressParallel(std::ifstream &ifs, std::streampos start,
+                                 std::vector<BlockIndexEntry>& index,
+                                 size_t first, size_t last,
+                                 uint64_t skip, uint64_t length,
+                                 const DecompressOptions &options,
+                                 std::ofstream &ofs);
+  static void DecompressParallel(const char *data,
+                                 std::vector<BlockIndexEntry>& index,
+                                 size_t first, size_t last,
+                                 uint64_t skip, uint64_t length,
+                                 const DecompressOptions &options,
+                                 std::ostream &os);
+
+  // Return true if the header announces a file with a block index
+  static bool HasIndex(BinaryInputStream& input);
+
+  // Decode the whole zap file from the start, one block after the other
+  // with the tables
+  static void DecompressStream(BinaryInputStream& input,
+                               DecodeMethod method, std::ostream &os,
+                               BlockDecodeTables& tables, Stats *stats);
+
+  // Recreate the tree from the binary input (unversioned files)
+  static HuffmanTree ReBuildTree(BinaryInputStream& input_stream);
+
+  // Helper method, return the index of the subtree read
+  static uint16_t HelperReBuildTree(BinaryInputStream& input_stream,
+                                    HuffmanTree& tree);
+
+  // Read the characters from the encoded binary strings (unversioned files),
+  // return their number
+  static uint32_t ReEncodeString(HuffmanTree& tree,
+                                 BinaryInputStream& input,
+                                 BinaryOutputStream& output);
 };
 
-//  Objective: Count the frequency of each character in the input file
-//             and store the input into a vector
-std::vector<size_t> Huffman::CountInputFreq(std::ifstream &ifs,
-                                            std::vector<char>& vec_input_file) {
-  // Create a vector of 128 spaces filled with 0 to store the frequency
-  std::vector<size_t> vec_char_freq(128, 0);
-  char cur_char;
+const uint32_t Huffman::kMagic;
+const uint8_t Huffman::kFormatVersion;
+const size_t Huffman::kHeaderSize;
+const uint32_t Huffman::kIndexMagic;
+const size_t Huffman::kIndexEntrySize;
+const size_t Huffman::kIndexTrailerSize;
+const uint8_t Huffman::kBlockHuffman;
+const uint8_t Huffman::kBlockEnd;
+const uint8_t Huffman::kBlockHuffmanInterleaved;
+const size_t Huffman::kInterleavedStreams;
+const uint8_t Huffman::kBlockShared;
+const uint8_t Huffman::kBlockSharedInterleaved;
+const uint8_t Huffman::kBlockAdaptive;
+const size_t Huffman::kAdaptiveReadSize;
+const uint8_t Huffman::kBlockContext;
+const uint8_t Huffman::kBlockStored;
+const size_t Huffman::kStoredCopySize;
+const size_t Huffman::kContextIterations;
+const size_t Huffman::kMaxContextGroups;
+const uint32_t Huffman::kTableMagic;
+const uint8_t Huffman::kTableVersion;
+const size_t Huffman::kDefaultBlockSize;
+const size_t Huffman::kMaxBlockSize;
+const size_t Huffman::kMinCodeLengthLimit;
+const size_t Huffman::kMaxCodeLength;
+const size_t Huffman::kNumBlockTypes;
+const size_t Huffman::kDecodeTableBits;
+
+const char *Huffman::BlockTypeName(size_t type) {
+  static const char *names[kNumBlockTypes] = {
+    "huffman", "huffman_interleaved", "shared", "shared_interleaved",
+    "adaptive", "context", "stored",
+  };
+  return type < kNumBlockTypes ? names[type] : "unknown";
+}
+
+Huffman::PhaseTimer::PhaseTimer(Stats *stats) : stats(stats) {
+  if (stats)
+    last = std::chrono::steady_clock::now();
+}
+
+void Huffman::PhaseTimer::Lap(double Stats::*phase) {
+  if (!stats)
+    return;
+
+  auto now = std::chrono::steady_clock::now();
+  stats->*phase += std::chrono::duration<double>(now - last).count();
+  last = now;
+}
+
+// Objective: The peak resident memory is kept by the kernel, in kilobytes
+void Huffman::PhaseTimer::Finish() {
+  if (!stats)
+    return;
+
+  Lap(&Stats::total_seconds);
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    stats->peak_memory = std::max<size_t>(stats->peak_memory,
+                                          size_t(usage.ru_maxrss) * 1024);
+}
+
+void Huffman::AddStats(const Stats &from, Stats &to) {
+  to.total_seconds += from.total_seconds;
+  to.read_seconds += from.read_seconds;
+  to.histogram_seconds += from.histogram_seconds;
+  to.tree_seconds += from.tree_seconds;
+  to.table_seconds += from.table_seconds;
+  to.encode_seconds += from.encode_seconds;
+  to.decode_seconds += from.decode_seconds;
+  to.write_seconds += from.write_seconds;
+  to.bytes_in += from.bytes_in;
+  to.bytes_out += from.bytes_out;
+  to.symbols += from.symbols;
+  for (size_t type = 0; type < kNumBlockTypes; type++)
+    to.blocks[type] += from.blocks[type];
+  to.entropy_bits += from.entropy_bits;
+  to.coded_bits += from.coded_bits;
+  to.peak_memory = std::max(to.peak_memory, from.peak_memory);
+}
+
+uint64_t Huffman::StreamSize(std::ifstream &ifs, std::streampos start) {
+  if (start == std::streampos(-1))
+    return 0;
 
-  // Find the index of the character and count up the value at that index
-  while (ifs >> std::noskipws >> cur_char) {
-    vec_input_file.push_back(cur_char);
-    vec_char_freq[cur_char]++;  // cur_char is int automatically
+  ifs.clear();
+  std::streampos end = ifs.seekg(0, std::ios::end).tellg();
+  return end == std::streampos(-1) ? 0 : static_cast<uint64_t>(end - start);
+}
+
+// Objective: Write the measures with their unit, the bits per character
+//            only when they were measured
+void Huffman::PrintStats(const Stats &stats, std::ostream &os) {
+  const struct {
+    const char *name;
+    double seconds;
+  } phases[] = {
+    {"read", stats.read_seconds},
+    {"histogram", stats.histogram_seconds},
+    {"tree", stats.tree_seconds},
+    {"table", stats.table_seconds},
+    {"encode", stats.encode_seconds},
+    {"decode", stats.decode_seconds},
+    {"write", stats.write_seconds},
+    {"total", stats.total_seconds},
+  };
+
+  std::ios::fmtflags flags = os.flags();
+  os.setf(std::ios::fixed);
+  std::streamsize precision = os.precision(6);
+  for (const auto &phase : phases)
+    os << phase.name << " seconds: " << phase.seconds << '\n';
+
+  os << "bytes in: " << stats.bytes_in << '\n'
+     << "bytes out: " << stats.bytes_out << '\n'
+     << "symbols: " << stats.symbols << '\n';
+  for (size_t type = 0; type < kNumBlockTypes; type++) {
+    if (stats.blocks[type])
+      os << BlockTypeName(type) << " blocks: " << stats.blocks[type] << '\n';
+  }
+  if (stats.symbols && stats.coded_bits) {
+    os.precision(4);
+    os << "entropy bits per symbol: " << stats.entropy_bits / stats.symbols
+       << '\n'
+       << "coded bits per symbol: "
+       << static_cast<double>(stats.coded_bits) / stats.symbols << '\n';
+  }
+  os << "peak memory bytes: " << stats.peak_memory << std::endl;
+
+  os.precision(precision);
+  os.flags(flags);
+}
+
+void Huffman::PrintStatsJson(const Stats &stats, std::ostream &os) {
+  double symbols = stats.symbols ? static_cast<double>(stats.symbols) : 1;
+
+  std::streamsize precision = os.precision(9);
+  os << "{\"read_seconds\": " << stats.read_seconds
+     << ", \"histogram_seconds\": " << stats.histogram_seconds
+     << ", \"tree_seconds\": " << stats.tree_seconds
+     << ", \"table_seconds\": " << stats.table_seconds
+     << ", \"encode_seconds\": " << stats.encode_seconds
+     << ", \"decode_seconds\": " << stats.decode_seconds
+     << ", \"write_seconds\": " << stats.write_seconds
+     << ", \"total_seconds\": " << stats.total_seconds
+     << ", \"bytes_in\": " << stats.bytes_in
+     << ", \"bytes_out\": " << stats.bytes_out
+     << ", \"symbols\": " << stats.symbols
+     << ", \"blocks\": {";
+  for (size_t type = 0; type < kNumBlockTypes; type++) {
+    os << (type ? ", \"" : "\"") << BlockTypeName(type) << "\": "
+       << stats.blocks[type];
   }
+  os << '}'
+     << ", \"entropy_bits_per_symbol\": " << stats.entropy_bits / symbols
+     << ", \"coded_bits_per_symbol\": " << stats.coded_bits / symbols
+     << ", \"peak_memory_bytes\": " << stats.peak_memory << '}' << std::endl;
+  os.precision(precision);
+}
+
+// Objective: Read up to block_size characters of the input file
+//            into the vector
+bool Huffman::ReadBlock(std::ifstream &ifs, size_t block_size,
+                        std::vector<char> &vec_input_file) {
+  vec_input_file.resize(block_size);
+  ifs.read(vec_input_file.data(), block_size);
+  vec_input_file.resize(ifs.gcount());
+  return !vec_input_file.empty();
+}
+
+//  Objective: Count the frequency of each character in the block
+void Huffman::CountInputFreq(const char *data, size_t size,
+                             std::vector<size_t>& freq) {
+  // 256 spaces filled with 0 to store the frequency of every byte value
+  freq.assign(256, 0);
 
-  return vec_char_freq;
+  CountBytes(data, size, freq.data());
 }
 
-// Objective: Push all characters into the priority queue
-//            and adujst into a huffman tree with only one element in the queue
-PQueue<HuffmanNode*, MyClassPtrCompMin<HuffmanNode*>>
-                              Huffman::BuildTree(std::vector<size_t>& input) {
-  PQueue<HuffmanNode*, MyClassPtrCompMin<HuffmanNode*>> pq;
-  // Create a HuffmanNode for each character and push them into the queue
+// Objective: Merge the two smallest nodes until only the root is left
+// Concept: Merged nodes are created in increasing order of frequency, so
+//          once the leaves are sorted the smallest node is at the front of
+//          either the leaves or the merged nodes, and no priority queue is
+//          needed. Nodes are ordered with HuffmanNode::operator<, as a
+//          priority queue of nodes would pop them; on equality the leaf
+//          comes first.
+void Huffman::BuildTree(std::vector<size_t>& input, HuffmanTree& tree) {
+  tree.Clear();
+  // Create a HuffmanNode for each character
   for (size_t i = 0; i < input.size(); i++) {
-    if (input[i] != 0) {
-      HuffmanNode* cur_node = new HuffmanNode(i, input[i], nullptr, nullptr);
-      pq.Push(cur_node);
-    }
+    if (input[i] != 0)
+      tree.AddNode(HuffmanNode(i, input[i]));
   }
 
+  // Sort the leaves once
+  uint16_t num_leaves = tree.Size();
+  std::array<uint16_t, 256> leaves;
+  for (uint16_t i = 0; i < num_leaves; i++)
+    leaves[i] = i;
+  std::sort(leaves.begin(), leaves.begin() + num_leaves,
+            [&](uint16_t a, uint16_t b) {
+    return tree.Node(a) < tree.Node(b);
+  });
+
+  // Merged nodes follow the leaves in the tree, from next_node to the end
+  size_t next_leaf = 0;
+  uint16_t next_node = num_leaves;
+  auto pop = [&]() -> uint16_t {
+    if (next_leaf < num_leaves &&
+        (next_node == tree.Size() ||
+         !(tree.Node(next_node) < tree.Node(leaves[next_leaf]))))
+      return leaves[next_leaf++];
+    return next_node++;
+  };
+
   // Adjust the tree to contain only one item
-  while (pq.Size() > 1) {
-    HuffmanNode* left_node = pq.Top();  // Pop the first to be the left
-    pq.Pop();
-    HuffmanNode* right_node = pq.Top();  // Pop the second to the right
-    pq.Pop();
-    int freq = left_node->freq() + right_node->freq();
-    HuffmanNode* new_node = new HuffmanNode(0, freq, left_node, right_node);
-    pq.Push(new_node);  // Push back in the new node
+  for (size_t i = 1; i < num_leaves; i++) {
+    uint16_t left_node = pop();  // Pop the first to be the left
+    uint16_t right_node = pop();  // Pop the second to the right
+    size_t freq = tree.Node(left_node).freq() + tree.Node(right_node).freq();
+    tree.AddNode(HuffmanNode(0, freq, left_node, right_node));
+  }
+}
+
+// Objective: Get the depth of every leaf of the huffman tree,
+//            characters that don't appear have a length of 0
+void Huffman::CodeLengths(HuffmanTree& tree, std::vector<uint8_t>& lengths) {
+  lengths.assign(256, 0);
+  if (tree.Empty())
+    return;
+
+  // A single character still needs a code of one bit
+  HelperCodeLengths(tree, tree.Root(), lengths,
+                    tree.Node(tree.Root()).IsLeaf() ? 1 : 0);
+}
+
+// Objective: Recursive helper method to traverse through the huffman tree
+void Huffman::HelperCodeLengths(HuffmanTree& tree, uint16_t n,
+                                std::vector<uint8_t>& lengths,
+                                size_t length) {
+  HuffmanNode& node = tree.Node(n);
+  if (node.IsLeaf()) {
+    lengths[static_cast<unsigned char>(node.data())] =
+        static_cast<uint8_t>(length);
+    return;
+  }
+
+  HelperCodeLengths(tree, node.left(), lengths, length + 1);
+  HelperCodeLengths(tree, node.right(), lengths, length + 1);
+}
+
+// Objective: Find the code lengths of minimal encoded size such that no code
+//            is longer than max_length, using the package-merge algorithm.
+// Concept: A character with a code of length l is worth 2^-l, and the codes
+//          are valid when the values add up to 1. Coins of value 2^-l are
+//          one per character and length l from 1 to max_length, weighing the
+//          character frequency; the lengths are given by the lightest set of
+//          coins adding up to n - 1.
+//          From the longest length, pairs of coins are packaged into coins
+//          worth twice as much and merged with the coins of the next length.
+//          The first 2n - 2 items of the last list are the lightest set, and
+//          each time a character appears in it adds one to its length.
+void Huffman::LimitCodeLengths(const std::vector<size_t>& input,
+                               size_t max_length,
+                               std::vector<uint8_t>& lengths,
+                               PackageMergeLists& package_merge) {
+  lengths.assign(256, 0);
+
+  // Characters sorted by frequency, then by character
+  std::vector<size_t>& symbols = package_merge.symbols;
+  symbols.clear();
+  for (size_t i = 0; i < input.size(); i++) {
+    if (input[i] != 0)
+      symbols.push_back(i);
+  }
+  std::sort(symbols.begin(), symbols.end(), [&](size_t a, size_t b) {
+    return input[a] < input[b] || (input[a] == input[b] && a < b);
+  });
+
+  size_t n = symbols.size();
+  if (n <= 1) {
+    // A single character still needs a code of one bit
+    for (size_t symbol : symbols)
+      lengths[symbol] = 1;
+    return;
+  }
+  if ((uint64_t(1) << max_length) < n)
+    throw std::length_error("Code length limit too small");
+
+  std::vector<std::vector<PackageItem>>& lists = package_merge.lists;
+  if (lists.size() < max_length)
+    lists.resize(max_length);
+  for (size_t level = 0; level < max_length; level++) {
+    std::vector<PackageItem>& list = lists[level];
+    list.clear();
+    list.reserve(2 * n);
+
+    // Merge the coins of the characters with the packages of the level below,
+    // characters first when weights are equal
+    size_t i = 0, j = 0;
+    size_t num_packages = level ? lists[level - 1].size() / 2 : 0;
+    while (i < n || j < num_packages) {
+      uint64_t package_weight = 0;
+      if (j < num_packages)
+        package_weight = lists[level - 1][2 * j].weight +
+                         lists[level - 1][2 * j + 1].weight;
+      if (i < n && (j == num_packages || input[symbols[i]] <= package_weight)) {
+        list.push_back(PackageItem{input[symbols[i]],
+                                   static_cast<int>(symbols[i])});
+        i++;
+      } else {
+        list.push_back(PackageItem{package_weight, -1});
+        j++;
+      }
+    }
+  }
+
+  // Packages selected at one level select the first items of the level below
+  size_t num_selected = 2 * n - 2;
+  for (size_t level = max_length; level-- > 0;) {
+    size_t num_packages = 0;
+    for (size_t i = 0; i < num_selected; i++) {
+      if (lists[level][i].symbol < 0)
+        num_packages++;
+      else
+        lengths[lists[level][i].symbol]++;
+    }
+    num_selected = 2 * num_packages;
   }
+}
 
-  return pq;
+// Objective: Write the magic bytes and the format version to the zap file
+void Huffman::OutputHeader(BinaryOutputStream& output) {
+  output.PutBits(kMagic, 24);
+  output.PutChar(kFormatVersion);
 }
 
-// Helper method for preorder traverse
-void Huffman::PreOrder(HuffmanNode& n, BinaryOutputStream& output) {
-  if (n.data() == 0) {
-    output.PutBit(0);  // Write 0 to the file when no character present
+// Objective: Write the code lengths to the zap file
+// Format: number of characters (9 bits), then if there are any the width
+//         of the lengths (3 bits) and either
+//         - 0 (1 bit), then (character (8 bits), length) for each character
+//         - 1 (1 bit), first and last characters (8 bits each), then for
+//           each character in between 1 (1 bit) and its length if it has a
+//           code, 0 (1 bit) otherwise
+//         whichever is the shortest
+void Huffman::OutputLengths(const std::vector<uint8_t>& lengths,
+                            BinaryOutputStream& output) {
+  size_t num_symbols = 0;
+  size_t max_length = 0;
+  size_t first = lengths.size();
+  size_t last = 0;
+  for (size_t i = 0; i < lengths.size(); i++) {
+    if (lengths[i] != 0) {
+      num_symbols++;
+      max_length = std::max<size_t>(max_length, lengths[i]);
+      first = std::min(first, i);
+      last = i;
+    }
+  }
+
+  output.PutBits(num_symbols, 9);
+  if (!num_symbols)
+    return;
+
+  // Number of bits needed to write every length
+  size_t width = 0;
+  while (max_length >> width)
+    width++;
+  output.PutBits(width, 3);
+
+  // Either list the characters, or mark them in their range
+  bool use_range = 16 + (last - first + 1) < 8 * num_symbols;
+  output.PutBit(use_range);
+  if (use_range) {
+    output.PutChar(first);
+    output.PutChar(last);
+    for (size_t i = first; i <= last; i++) {
+      output.PutBit(lengths[i] != 0);
+      if (lengths[i] != 0)
+        output.PutBits(lengths[i], width);
+    }
   } else {
-    output.PutBit(1);  // Write 1 to the file when there is character
-    output.PutChar(n.data());
+    for (size_t i = 0; i < lengths.size(); i++) {
+      if (lengths[i] != 0) {
+        output.PutChar(i);
+        output.PutBits(lengths[i], width);
+      }
+    }
+  }
+}
+
+// Objective: Count the bits of the layout chosen by OutputLengths
+size_t Huffman::LengthsBits(std::vector<uint8_t>& lengths) {
+  size_t num_symbols = 0;
+  size_t max_length = 0;
+  size_t first = lengths.size();
+  size_t last = 0;
+  for (size_t i = 0; i < lengths.size(); i++) {
+    if (lengths[i] != 0) {
+      num_symbols++;
+      max_length = std::max<size_t>(max_length, lengths[i]);
+      first = std::min(first, i);
+      last = i;
+    }
+  }
+  if (!num_symbols)
+    return 9;
+
+  size_t width = 0;
+  while (max_length >> width)
+    width++;
+
+  bool use_range = 16 + (last - first + 1) < 8 * num_symbols;
+  if (use_range)
+    return 9 + 3 + 1 + 16 + (last - first + 1) + num_symbols * width;
+  return 9 + 3 + 1 + num_symbols * (8 + width);
+}
+
+// Objective: Hash the lengths with 32-bit FNV-1a
+uint32_t Huffman::TableId(const std::vector<uint8_t>& lengths) {
+  uint32_t hash = 2166136261u;
+  for (uint8_t length : lengths)
+    hash = (hash ^ length) * 16777619u;
+  return hash;
+}
+
+// Objective: Compare the bits of the characters with each code, the id of
+//            the shared table against the code lengths of the block
+bool Huffman::UseSharedTable(std::vector<size_t>& freq,
+                             std::vector<uint8_t>& lengths,
+                             const SharedTable& table,
+                             size_t max_code_length) {
+  // A table trained with a higher limit can't be used
+  if (*std::max_element(table.lengths.begin(), table.lengths.end()) >
+      max_code_length)
+    return false;
+
+  uint64_t shared_bits = 32;
+  uint64_t own_bits = LengthsBits(lengths);
+
+  for (size_t i = 0; i < freq.size(); i++) {
+    if (freq[i] != 0) {
+      // The shared table can't code every character
+      if (!table.lengths[i])
+        return false;
+      shared_bits += uint64_t(freq[i]) * table.lengths[i];
+      own_bits += uint64_t(freq[i]) * lengths[i];
+    }
+  }
+
+  return shared_bits <= own_bits;
+}
+
+// Objective: Build a code for the samples in which every byte value counts
+//            once more than it appears
+Huffman::SharedTable Huffman::TrainTable(const char *data, size_t size,
+                                         size_t max_code_length) {
+  if (max_code_length < kMinCodeLengthLimit ||
+      max_code_length > kMaxCodeLength)
+    throw std::invalid_argument("Code length limit out of range");
+
+  std::vector<size_t> freq;
+  CountInputFreq(data, size, freq);
+  for (size_t& count : freq)
+    count++;
+
+  SharedTable table;
+  HuffmanTree tree;
+  BuildTree(freq, tree);
+  CodeLengths(tree, table.lengths);
+  if (*std::max_element(table.lengths.begin(), table.lengths.end()) >
+      max_code_length) {
+    PackageMergeLists package_merge;
+    LimitCodeLengths(freq, max_code_length, table.lengths, package_merge);
   }
+  table.id = TableId(table.lengths);
 
-  // check terminating condition
-  if (!n.left()) return;
-  // if fine, recursion to left
-  PreOrder(*(n.left()), output);
+  return table;
+}
 
-  // check terminating condition
-  if (!n.right()) return;
-  // if fine, recursion to right
-  PreOrder(*(n.right()), output);
+void Huffman::WriteTable(const SharedTable &table, std::ostream &os) {
+  BinaryOutputStream output(os);
+  output.PutBits(kTableMagic, 24);
+  output.PutChar(kTableVersion);
+  output.PutInt(table.id);
+  OutputLengths(table.lengths, output);
 }
 
-// Objective: Write the contents of the tree to the zap file
-void Huffman::OutputTree(PQueue<HuffmanNode*,
-                         MyClassPtrCompMin<HuffmanNode*>>& pq,
-                         BinaryOutputStream& output) {
-  PreOrder(*(pq.Top()), output);
+// Objective: Read a table written by WriteTable, checking that it is one
+Huffman::SharedTable Huffman::ReadTable(const char *data, size_t size) {
+  BinaryInputStream input(data, size);
+  if (input.PeekBits(24) != kTableMagic)
+    throw std::runtime_error("Not a zap table file");
+  input.ConsumeBits(24);
+  if (static_cast<uint8_t>(input.GetChar()) != kTableVersion)
+    throw std::runtime_error("Unsupported zap table file version");
+
+  SharedTable table;
+  table.id = input.GetInt();
+  ReadLengths(input, table.lengths);
+  if (table.id != TableId(table.lengths))
+    throw std::runtime_error("Corrupted zap table file");
+
+  // The lengths must make a code
+  DecodeTable decode_table;
+  BuildDecodeTable(table.lengths, decode_table);
+
+  return table;
 }
 
 // Objective: Write the number of characters to the zap file
@@ -179,128 +1240,1651 @@ void Huffman::OutputNumChar(std::vector<size_t>& input,
   output.PutInt(num_total);
 }
 
-// Objective: Get the string encoding corresponding to each character
-std::vector<std::string> Huffman::BuildTable(HuffmanNode& n) {
-  // Create a vector of 128 empty string to fill the encoding string
-  std::vector<std::string> code_table(128);
-  std::vector<char> encoding;  // A vector of char to store the current encoding
+// Objective: Assign canonical codes from the code lengths: shorter codes
+//            come first, and codes of the same length follow the characters
+//            order, so that the lengths alone describe the code
+void Huffman::BuildTable(const std::vector<uint8_t>& lengths,
+                         std::vector<HuffmanCode>& code_table) {
+  // Count the characters of each length
+  size_t count[kMaxCodeLength + 1] = {0};
+  for (size_t i = 0; i < lengths.size(); i++)
+    count[lengths[i]]++;
+  count[0] = 0;
+
+  // Find the first code of each length
+  uint64_t next_code[kMaxCodeLength + 1] = {0};
+  uint64_t code = 0;
+  for (size_t length = 1; length <= kMaxCodeLength; length++) {
+    code = (code + count[length - 1]) << 1;
+    next_code[length] = code;
+  }
 
-  HelperBuildTable(n, code_table, encoding);
-  return code_table;
+  // Fill a table for every byte value, unused characters have no code
+  code_table.assign(256, HuffmanCode{0, 0});
+  for (size_t i = 0; i < lengths.size(); i++) {
+    if (lengths[i] != 0)
+      code_table[i] = HuffmanCode{static_cast<uint32_t>(
+                                      next_code[lengths[i]]++), lengths[i]};
+  }
 }
 
-// Objective: Recursive helper method to traverse through the huffman tree
-//            to obtain the encoding
-void Huffman::HelperBuildTable(HuffmanNode& n,
-                               std::vector<std::string>& code_table,
-                               std::vector<char>& encoding) {
-  if (n.data() != 0) {
-    std::string temp;
-
-    //  Copy the current state of encoding string to temp
-    for (auto itr : encoding)
-      temp.push_back(itr);
-
-    code_table[n.data()] = temp;  // Assign temp to the corresponding character
-    encoding.pop_back();  // Pop when reaching a leaf node
-    return;
+// Objective: Write the input characters as encoded strings in sequence
+void Huffman::OutputChar(std::vector<HuffmanCode>& code_table,
+                         BinaryOutputStream& output,
+                         const char *data, size_t size) {
+  // Write the whole code of every character at once
+  for (size_t i = 0; i < size; i++) {
+    const HuffmanCode& code = code_table[static_cast<unsigned char>(data[i])];
+    output.PutBits(code.bits, code.length);
   }
+}
 
-  encoding.push_back(48);  // Push 0 in if goes left
-  HelperBuildTable(*(n.left()), code_table, encoding);
+// Objective: Write every kInterleavedStreams-th character to its own stream,
+//            and the streams one after the other with their sizes first
+void Huffman::OutputInterleaved(BlockEncodeTables& tables,
+                                BinaryOutputStream& output,
+                                const char *data, size_t size) {
+  const std::vector<HuffmanCode>& code_table = tables.code_table;
+  std::string (&streams)[kInterleavedStreams] = tables.streams;
 
-  encoding.push_back(49);  // Push 1 in if goes right
-  HelperBuildTable(*(n.right()), code_table, encoding);
+  for (size_t stream = 0; stream < kInterleavedStreams; stream++) {
+    streams[stream].clear();
+    StringOutputBuffer buffer(streams[stream]);
+    std::ostream coded(&buffer);
+    BinaryOutputStream stream_output(coded);
+    for (size_t i = stream; i < size; i += kInterleavedStreams) {
+      const HuffmanCode& code =
+          code_table[static_cast<unsigned char>(data[i])];
+      stream_output.PutBits(code.bits, code.length);
+    }
+  }
 
-  if (!encoding.empty())
-  encoding.pop_back();  // Pop when we already go through two children
+  output.AlignToByte();
+  for (const std::string& stream : streams)
+    output.PutInt(stream.size());
+  for (const std::string& stream : streams)
+    output.PutBytes(stream.data(), stream.size());
 }
-// Objective: Write the input characters as encoded strings in sequence
-void Huffman::OutputChar(std::vector<std::string>& code_table,
-                         BinaryOutputStream& output,
-                         std::vector<char>& vec_input_file) {
-  char cur_char;
-  // Iterate through every character
-  for (size_t i = 0; i < vec_input_file.size(); i++) {
-    cur_char = vec_input_file[i];
-    // Iterate through the encoded string bit by bit
-    for (size_t j = 0; j  < code_table[cur_char].size(); j++) {
-      if (code_table[cur_char][j] == 48)  // Check if the bit is 0
-        output.PutBit(0);
-      else                               // The bit is else 1
-        output.PutBit(1);
+
+// Objective: Bound the size of the block from its counts alone, before any
+//            code is built
+// Concept: No code takes fewer bits than the entropy of the characters. The
+//          code lengths take at least a bit per character used, unless they
+//          come from the shared table. Tables chosen by the previous
+//          character can go below that entropy, but not below the entropy
+//          of every character given the one before (grouping the contexts
+//          only adds to it), and their groups take a bit per context.
+double Huffman::MinCodedBits(const BlockEncodeTables& tables, size_t size,
+                             const CompressOptions &options) {
+  const std::vector<size_t>& freq = tables.freq;
+  size_t num_symbols = freq.size() - std::count(freq.begin(), freq.end(), 0);
+  double bits =
+      EntropyBits(freq, size) + (options.table ? 32 : 9 + num_symbols);
+  if (options.context_groups <= 1)
+    return bits;
+
+  double context_bits = 8 + 256;
+  for (size_t ctx = 0; ctx < 256; ctx++) {
+    const uint32_t *row = &tables.context_freq[ctx << 8];
+    uint64_t total = 0;
+    for (size_t c = 0; c < 256; c++)
+      total += row[c];
+    for (size_t c = 0; c < 256; c++) {
+      if (row[c] != 0)
+        context_bits += row[c] * std::log2(static_cast<double>(total) /
+                                           row[c]);
     }
   }
+  return std::min(bits, context_bits);
 }
 
+double Huffman::EntropyBits(const std::vector<size_t>& freq, size_t size) {
+  double bits = 0;
+  for (size_t i = 0; i < freq.size(); i++) {
+    if (freq[i] != 0)
+      bits += freq[i] * std::log2(static_cast<double>(size) / freq[i]);
+  }
+  return bits;
+}
 
-void Huffman::Compress(std::ifstream &ifs, std::ofstream &ofs) {
-  std::vector<char> vec_input_file;
+void Huffman::AddStoredStats(const std::vector<size_t>& freq, size_t size,
+                             Stats &stats) {
+  stats.bytes_in += size;
+  stats.symbols += size;
+  stats.entropy_bits += EntropyBits(freq, size);
+  stats.coded_bits += 8 * uint64_t(size);
+  stats.blocks[kBlockStored]++;
+}
 
-  std::vector<size_t> vec_char_freq = CountInputFreq(ifs, vec_input_file);
-  PQueue<HuffmanNode*, MyClassPtrCompMin<HuffmanNode*>> input_pq =
-                                                 BuildTree(vec_char_freq);
-  std::vector<std::string> code_table = BuildTable(*(input_pq.Top()));
+// Objective: Write the number of characters, then the characters as they
+//            are, at a byte boundary since the block type is
+void Huffman::OutputStored(BinaryOutputStream& output,
+                           const char *data, size_t size) {
+  output.PutChar(kBlockStored);
+  output.PutInt(size);
+  output.PutBytes(data, size);
+}
 
-  BinaryOutputStream output_tree(ofs);
+// Objective: Count the order-1 frequencies, by previous character then
+//            character
+void Huffman::CountContextFreq(const char *data, size_t size,
+                               std::vector<uint32_t>& context_freq) {
+  context_freq.assign(256 * 256, 0);
 
-  OutputTree(input_pq, output_tree);
-  OutputNumChar(vec_char_freq, output_tree);
-  OutputChar(code_table, output_tree, vec_input_file);
+  unsigned char prev = 0;
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = data[i];
+    context_freq[prev << 8 | c]++;
+    prev = c;
+  }
 }
 
-// Objective: Recursive recreate the huffman tree
-HuffmanNode* Huffman::ReBuildTree(BinaryInputStream& input_stream) {
-  int cur_bit = input_stream.GetBit();
-  // Create a HuffmanNode with char based on the input binary string
-  if (cur_bit == 1) {
-    HuffmanNode* char_node_ = new HuffmanNode(input_stream.GetChar(), 0);
-    return char_node_;
+// Objective: Share a few tables between contexts that are followed by
+//            alike characters, so that their code lengths cost less than
+//            they save
+// Concept: The most frequent contexts start the groups. Then every context
+//          joins the group whose counts would code its characters in the
+//          fewest bits, and the groups are counted again (k-means), until
+//          no context moves. Empty groups are dropped.
+size_t Huffman::GroupContexts(BlockEncodeTables& tables, size_t max_groups) {
+  const std::vector<uint32_t>& freq = tables.context_freq;
+  std::vector<uint8_t>& group = tables.context_group;
+  std::vector<size_t>& group_freq = tables.group_freq;
+  std::vector<double>& cost = tables.group_cost;
+
+  // Contexts followed by characters, most frequent first
+  uint64_t totals[256] = {0};
+  size_t contexts[256];
+  size_t num_contexts = 0;
+  for (size_t ctx = 0; ctx < 256; ctx++) {
+    for (size_t c = 0; c < 256; c++)
+      totals[ctx] += freq[ctx << 8 | c];
+    if (totals[ctx])
+      contexts[num_contexts++] = ctx;
   }
+  std::sort(contexts, contexts + num_contexts, [&](size_t a, size_t b) {
+    return totals[a] > totals[b] || (totals[a] == totals[b] && a < b);
+  });
 
-  // Initilize the left and right node
-  HuffmanNode* left_subtree = new HuffmanNode(0, 0);
-  HuffmanNode* right_subtree = new HuffmanNode(0, 0);
+  size_t num_groups = std::min(max_groups, num_contexts);
+  group.assign(256, 0);
+  for (size_t i = 0; i < num_groups; i++)
+    group[contexts[i]] = i;
 
-  left_subtree = std::move(ReBuildTree(input_stream));
-  right_subtree = std::move(ReBuildTree(input_stream));
+  // Count the characters of every group from its contexts, only the first
+  // contexts are placed before the first round
+  auto count_groups = [&](size_t count) {
+    group_freq.assign(num_groups * 256, 0);
+    for (size_t i = 0; i < count; i++) {
+      size_t ctx = contexts[i];
+      for (size_t c = 0; c < 256; c++)
+        group_freq[group[ctx] << 8 | c] += freq[ctx << 8 | c];
+    }
+  };
+  count_groups(num_groups);
 
-  // Build the parent node
-  HuffmanNode* cur_node_ = new HuffmanNode(0, 0, left_subtree, right_subtree);
-  return cur_node_;
+  for (size_t round = 0;
+       round < kContextIterations && num_contexts > num_groups; round++) {
+    // Bits of every character in every group, with one more count each so
+    // that characters not in a group have a cost too
+    cost.resize(num_groups * 256);
+    for (size_t g = 0; g < num_groups; g++) {
+      size_t total = 256;
+      for (size_t c = 0; c < 256; c++)
+        total += group_freq[g << 8 | c];
+      for (size_t c = 0; c < 256; c++)
+        cost[g << 8 | c] = std::log2(static_cast<double>(total) /
+                                     (group_freq[g << 8 | c] + 1));
+    }
+
+    bool moved = round == 0;
+    for (size_t i = 0; i < num_contexts; i++) {
+      size_t ctx = contexts[i];
+      size_t best = group[ctx];
+      double best_bits = HUGE_VAL;
+      for (size_t g = 0; g < num_groups; g++) {
+        double bits = 0;
+        for (size_t c = 0; c < 256; c++)
+          bits += freq[ctx << 8 | c] * cost[g << 8 | c];
+        if (bits < best_bits) {
+          best_bits = bits;
+          best = g;
+        }
+      }
+      moved |= best != group[ctx];
+      group[ctx] = best;
+    }
+
+    count_groups(num_contexts);
+    if (!moved)
+      break;
+  }
+
+  // Number the groups left in order
+  uint8_t number[kMaxContextGroups];
+  size_t num_used = 0;
+  for (size_t g = 0; g < num_groups; g++) {
+    uint64_t total = 0;
+    for (size_t c = 0; c < 256; c++)
+      total += group_freq[g << 8 | c];
+    if (!total)
+      continue;
+    number[g] = num_used;
+    std::copy(group_freq.begin() + (g << 8),
+              group_freq.begin() + ((g + 1) << 8),
+              group_freq.begin() + (num_used << 8));
+    num_used++;
+  }
+  group_freq.resize(num_used * 256);
+  for (size_t i = 0; i < num_contexts; i++)
+    group[contexts[i]] = number[group[contexts[i]]];
+  return num_used;
 }
 
-// Objective: Write the char to unzap file in the correct sequence
-void Huffman::ReEncodeString(PQueue<HuffmanNode*,
-                             MyClassPtrCompMin<HuffmanNode*>> &pq,
-                             BinaryInputStream& input,
-                             BinaryOutputStream& output) {
-  int num_char = input.GetInt();  // Get the number of char input
-  bool cur_bit;
+// Objective: Build the code of every group as the code of a block
+size_t Huffman::BuildContextTables(const CompressOptions &options,
+                                   BlockEncodeTables& tables) {
+  size_t num_groups = GroupContexts(tables, options.context_groups);
 
-  for (int i = 0; i < num_char; i++) {
-    HuffmanNode* n = pq.Top();
-    while (n->data() == 0) {
-      cur_bit = input.GetBit();
-      // Go to right if the bit is 1
-      if (cur_bit)
-        n = std::move(n->right());
-      // Go to left if the bit is 0
-      else
-        n = std::move(n->left());
-    }
-    output.PutChar(n->data());
+  size_t bits = 8 + 256 * ContextGroupBits(num_groups);
+  tables.group_lengths.resize(num_groups * 256);
+  tables.group_codes.resize(num_groups * 256);
+  for (size_t g = 0; g < num_groups; g++) {
+    std::vector<size_t>& row_freq = tables.row_freq;
+    std::vector<uint8_t>& row_lengths = tables.row_lengths;
+    row_freq.assign(tables.group_freq.begin() + (g << 8),
+                    tables.group_freq.begin() + ((g + 1) << 8));
+
+    BuildTree(row_freq, tables.tree);
+    CodeLengths(tables.tree, row_lengths);
+    if (*std::max_element(row_lengths.begin(), row_lengths.end()) >
+        options.max_code_length)
+      LimitCodeLengths(row_freq, options.max_code_length, row_lengths,
+                       tables.package_merge);
+    BuildTable(row_lengths, tables.code_table);
+
+    bits += LengthsBits(row_lengths);
+    for (size_t c = 0; c < 256; c++)
+      bits += row_freq[c] * row_lengths[c];
+
+    std::copy(row_lengths.begin(), row_lengths.end(),
+              tables.group_lengths.begin() + (g << 8));
+    std::copy(tables.code_table.begin(), tables.code_table.end(),
+              tables.group_codes.begin() + (g << 8));
   }
+  return bits;
 }
 
-void Huffman::Decompress(std::ifstream &ifs, std::ofstream &ofs) {
-  BinaryInputStream input_stream(ifs);
-  BinaryOutputStream output_stream(ofs);
+size_t Huffman::ContextGroupBits(size_t num_groups) {
+  size_t bits = 1;
+  while ((num_groups - 1) >> bits)
+    bits++;
+  return bits;
+}
+
+// Objective: Write the number of groups, the group of every context, then
+//            the code lengths of every group
+void Huffman::OutputContextTables(BlockEncodeTables& tables,
+                                  BinaryOutputStream& output) {
+  size_t num_groups = tables.group_lengths.size() / 256;
+  output.PutBits(num_groups - 1, 8);
 
-  PQueue<HuffmanNode*, MyClassPtrCompMin<HuffmanNode*>> pq;
+  size_t group_bits = ContextGroupBits(num_groups);
+  for (size_t ctx = 0; ctx < 256; ctx++)
+    output.PutBits(tables.context_group[ctx], group_bits);
 
-  pq.Push(ReBuildTree(input_stream));
-  ReEncodeString(pq, input_stream, output_stream);
+  for (size_t g = 0; g < num_groups; g++) {
+    tables.row_lengths.assign(tables.group_lengths.begin() + (g << 8),
+                              tables.group_lengths.begin() + ((g + 1) << 8));
+    OutputLengths(tables.row_lengths, output);
+  }
+}
+
+// Objective: Write every character with the codes of the group of the
+//            character before it, found without a branch through the row of
+//            every context
+void Huffman::OutputContextChar(const BlockEncodeTables& tables,
+                                BinaryOutputStream& output,
+                                const char *data, size_t size) {
+  const HuffmanCode *codes = tables.group_codes.data();
+  const HuffmanCode *rows[256];
+  for (size_t ctx = 0; ctx < 256; ctx++)
+    rows[ctx] = codes + (tables.context_group[ctx] << 8);
+
+  unsigned char prev = 0;
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = data[i];
+    const HuffmanCode& code = rows[prev][c];
+    output.PutBits(code.bits, code.length);
+    prev = c;
+  }
+}
+
+// Objective: Code the block with its own table, and write it to the zap file
+void Huffman::CompressBlock(const char *data, size_t size,
+                            const CompressOptions &options,
+                            BinaryOutputStream& output,
+                            BlockEncodeTables& tables, Stats *stats) {
+  std::vector<size_t>& vec_char_freq = tables.freq;
+  std::vector<uint8_t>& lengths = tables.lengths;
+
+  PhaseTimer timer(stats);
+  CountInputFreq(data, size, vec_char_freq);
+  if (options.context_groups > 1)
+    CountContextFreq(data, size, tables.context_freq);
+  timer.Lap(&Stats::histogram_seconds);
+
+  // Blocks no code could make shorter, e.g. of compressed data, are stored
+  // without building one
+  if (MinCodedBits(tables, size, options) >= 8.0 * size) {
+    OutputStored(output, data, size);
+    timer.Lap(&Stats::encode_seconds);
+    if (stats)
+      AddStoredStats(vec_char_freq, size, *stats);
+    return;
+  }
+
+  BuildTree(vec_char_freq, tables.tree);
+
+  // Only the code lengths are needed from the tree
+  CodeLengths(tables.tree, lengths);
+
+  // Find other lengths if the tree is too deep
+  if (*std::max_element(lengths.begin(), lengths.end()) >
+      options.max_code_length)
+    LimitCodeLengths(vec_char_freq, options.max_code_length, lengths,
+                     tables.package_merge);
+  timer.Lap(&Stats::tree_seconds);
+
+  // Small blocks are shorter with a shared table, which needs no lengths
+  bool shared = options.table &&
+                UseSharedTable(vec_char_freq, lengths, *options.table,
+                               options.max_code_length);
+  const std::vector<uint8_t>& code_lengths =
+      shared ? options.table->lengths : lengths;
+
+  size_t table_bits = shared ? 32 : LengthsBits(lengths);
+  for (size_t i = 0; i < vec_char_freq.size(); i++)
+    table_bits += vec_char_freq[i] * code_lengths[i];
+  if (options.interleaved)
+    table_bits += kInterleavedStreams * 32;
+
+  // Tables chosen by the previous character replace the table of the block
+  // when they take fewer bits with their lengths
+  bool context = false;
+  size_t block_bits = table_bits;
+  if (options.context_groups > 1 && size) {
+    size_t context_bits = BuildContextTables(options, tables);
+    context = context_bits < table_bits;
+    block_bits = std::min(context_bits, table_bits);
+  }
+
+  // The bound above may miss blocks the code wouldn't make shorter
+  if (block_bits >= 8 * size) {
+    timer.Lap(&Stats::table_seconds);
+    OutputStored(output, data, size);
+    timer.Lap(&Stats::encode_seconds);
+    if (stats)
+      AddStoredStats(vec_char_freq, size, *stats);
+    return;
+  }
+
+  std::vector<HuffmanCode>& code_table = tables.code_table;
+  if (!context)
+    BuildTable(code_lengths, code_table);
+  timer.Lap(&Stats::table_seconds);
+
+  if (context) {
+    output.PutChar(kBlockContext);
+    OutputContextTables(tables, output);
+  } else if (shared) {
+    output.PutChar(options.interleaved ? kBlockSharedInterleaved
+                                       : kBlockShared);
+    output.PutInt(options.table->id);
+  } else {
+    output.PutChar(options.interleaved ? kBlockHuffmanInterleaved
+                                       : kBlockHuffman);
+    OutputLengths(lengths, output);
+  }
+  OutputNumChar(vec_char_freq, output);
+  if (context)
+    OutputContextChar(tables, output, data, size);
+  else if (options.interleaved)
+    OutputInterleaved(tables, output, data, size);
+  else
+    OutputChar(code_table, output, data, size);
+  output.AlignToByte();
+  timer.Lap(&Stats::encode_seconds);
+
+  // Bits of the characters against the entropy of the block
+  if (stats) {
+    if (context)
+      stats->blocks[kBlockContext]++;
+    else if (shared)
+      stats->blocks[options.interleaved ? kBlockSharedInterleaved
+                                        : kBlockShared]++;
+    else
+      stats->blocks[options.interleaved ? kBlockHuffmanInterleaved
+                                        : kBlockHuffman]++;
+    stats->bytes_in += size;
+    stats->symbols += size;
+    stats->entropy_bits += EntropyBits(vec_char_freq, size);
+    if (!context) {
+      for (size_t i = 0; i < vec_char_freq.size(); i++)
+        stats->coded_bits += uint64_t(vec_char_freq[i]) * code_lengths[i];
+    }
+    // The order-1 codes can go below the entropy of the characters
+    if (context) {
+      for (size_t i = 0; i < tables.group_freq.size(); i++)
+        stats->coded_bits +=
+            uint64_t(tables.group_freq[i]) * tables.group_lengths[i];
+    }
+  }
+}
+
+// Objective: Share the calls to fn between up to threads threads, the
+//            calling thread included. The first exception thrown by fn is
+//            thrown again once every thread is done.
+template <typename F>
+void Huffman::ParallelFor(size_t count, size_t threads, F fn) {
+  std::atomic<size_t> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  // Every thread takes the next index until there are none left
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      try {
+        fn(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < std::min(count, threads); i++)
+    pool.emplace_back(worker);
+  worker();
+  for (auto& thread : pool)
+    thread.join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// Objective: Code the blocks at once into memory, and write them in order.
+//            Blocks are independent and end on a byte boundary, so the
+//            output is the same for any number of threads.
+void Huffman::CompressBlocks(std::vector<BlockData>& blocks,
+                             const CompressOptions &options,
+                             std::vector<std::string>& coded_blocks,
+                             std::vector<BlockIndexEntry>& index,
+                             uint64_t& offset, std::ostream &os) {
+  coded_blocks.resize(std::max(coded_blocks.size(), blocks.size()));
+
+  // Blocks are measured on their own, then added in order
+  std::vector<Stats> block_stats(options.stats ? blocks.size() : 0);
+  ParallelFor(blocks.size(), options.threads, [&](size_t i) {
+    std::ostringstream coded(std::ios::out | std::ios::binary);
+    {
+      BinaryOutputStream output(coded);
+      BlockEncodeTables tables;
+      CompressBlock(blocks[i].data, blocks[i].size, options, output, tables,
+                    options.stats ? &block_stats[i] : nullptr);
+    }
+    coded_blocks[i] = coded.str();
+  });
+
+  PhaseTimer timer(options.stats);
+  for (size_t i = 0; i < blocks.size(); i++) {
+    os.write(coded_blocks[i].data(), coded_blocks[i].size());
+    index.push_back(BlockIndexEntry{offset, static_cast<uint32_t>(
+                                                blocks[i].size)});
+    offset += coded_blocks[i].size();
+  }
+  timer.Lap(&Stats::write_seconds);
+
+  for (const Stats& measured : block_stats)
+    AddStats(measured, *options.stats);
+}
+
+void Huffman::CheckOptions(const CompressOptions &options) {
+  if (options.max_code_length < kMinCodeLengthLimit ||
+      options.max_code_length > kMaxCodeLength)
+    throw std::invalid_argument("Code length limit out of range");
+  if (options.block_size == 0 || options.block_size > kMaxBlockSize)
+    throw std::invalid_argument("Block size out of range");
+  if (options.threads == 0)
+    throw std::invalid_argument("Number of threads out of range");
+  if (options.table && options.table->lengths.size() != 256)
+    throw std::invalid_argument("Shared table without 256 code lengths");
+  if (options.context_groups == 0 ||
+      options.context_groups > kMaxContextGroups)
+    throw std::invalid_argument("Number of context groups out of range");
+}
+
+void Huffman::Compress(std::ifstream &ifs, std::ofstream &ofs) {
+  Compress(ifs, ofs, CompressOptions());
+}
+
+void Huffman::Compress(std::ifstream &ifs, std::ofstream &ofs,
+                       const CompressOptions &options) {
+  CheckOptions(options);
+  PhaseTimer total(options.stats);
+  {
+    BinaryOutputStream output(ofs);
+    OutputHeader(output);
+  }
+
+  // Read one block per thread, and code them at once
+  std::vector<std::vector<char>> vec_input_files(options.threads);
+  std::vector<BlockData> blocks;
+  std::vector<std::string> coded_blocks;
+  std::vector<BlockIndexEntry> index;
+  uint64_t offset = kHeaderSize;
+  for (;;) {
+    PhaseTimer timer(options.stats);
+    blocks.clear();
+    while (blocks.size() < vec_input_files.size() &&
+           ReadBlock(ifs, options.block_size, vec_input_files[blocks.size()])) {
+      std::vector<char> &vec_input_file = vec_input_files[blocks.size()];
+      blocks.push_back(BlockData{vec_input_file.data(), vec_input_file.size()});
+    }
+    timer.Lap(&Stats::read_seconds);
+    if (blocks.empty())
+      break;
+
+    CompressBlocks(blocks, options, coded_blocks, index, offset, ofs);
+  }
+
+  {
+    BinaryOutputStream output(ofs);
+    output.PutChar(kBlockEnd);
+    OutputIndex(index, output);
+  }
+
+  if (options.stats)
+    options.stats->bytes_out += offset + 1 + IndexSize(index);
+  total.Finish();
+}
+
+void Huffman::Compress(const char *data, size_t size, std::ostream &os,
+                       const CompressOptions &options) {
+  CheckOptions(options);
+  PhaseTimer total(options.stats);
+  {
+    BinaryOutputStream output(os);
+    OutputHeader(output);
+  }
+
+  // Code one block per thread at once, straight from memory
+  std::vector<BlockData> blocks;
+  std::vector<std::string> coded_blocks;
+  std::vector<BlockIndexEntry> index;
+  uint64_t offset = kHeaderSize;
+  for (size_t pos = 0; pos < size;) {
+    blocks.clear();
+    while (blocks.size() < options.threads && pos < size) {
+      size_t block_size = std::min(options.block_size, size - pos);
+      blocks.push_back(BlockData{data + pos, block_size});
+      pos += block_size;
+    }
+
+    CompressBlocks(blocks, options, coded_blocks, index, offset, os);
+  }
+
+  {
+    BinaryOutputStream output(os);
+    output.PutChar(kBlockEnd);
+    OutputIndex(index, output);
+  }
+
+  if (options.stats)
+    options.stats->bytes_out += offset + 1 + IndexSize(index);
+  total.Finish();
+}
+
+// Objective: Read the code lengths written by OutputLengths
+void Huffman::ReadLengths(BinaryInputStream& input,
+                          std::vector<uint8_t>& lengths) {
+  lengths.assign(256, 0);
+
+  size_t num_symbols = input.GetBits(9);
+  if (num_symbols > lengths.size())
+    throw std::runtime_error("Corrupted zap file");
+  if (!num_symbols)
+    return;
+
+  size_t width = input.GetBits(3);
+  if (input.GetBit()) {
+    size_t first = static_cast<unsigned char>(input.GetChar());
+    size_t last = static_cast<unsigned char>(input.GetChar());
+    for (size_t i = first; i <= last; i++) {
+      if (input.GetBit())
+        lengths[i] = input.GetBits(width);
+    }
+  } else {
+    for (size_t i = 0; i < num_symbols; i++) {
+      unsigned char symbol = input.GetChar();
+      lengths[symbol] = input.GetBits(width);
+    }
+  }
+}
+
+// Objective: Create the tables to decode the canonical code of the lengths.
+//            The main table is indexed by the next table_bits bits of the
+//            input so that one lookup resolves a whole code.
+void Huffman::BuildDecodeTable(std::vector<uint8_t>& lengths,
+                               DecodeTable& table) {
+  // Count the characters of each length
+  std::fill(table.count, table.count + kMaxCodeLength + 1, 0);
+  table.max_length = 0;
+  for (size_t i = 0; i < lengths.size(); i++) {
+    if (lengths[i] > kMaxCodeLength)
+      throw std::runtime_error("Corrupted zap file");
+    table.count[lengths[i]]++;
+    table.max_length = std::max<size_t>(table.max_length, lengths[i]);
+  }
+  table.count[0] = 0;
+
+  // The codes must not overflow their length (a single code may be alone)
+  int64_t codes_left = 1;
+  size_t num_symbols = 0;
+  for (size_t length = 1; length <= table.max_length; length++) {
+    codes_left = 2 * codes_left - table.count[length];
+    num_symbols += table.count[length];
+    if (codes_left < 0)
+      throw std::runtime_error("Corrupted zap file");
+  }
+  if (codes_left > 0 && num_symbols > 1)
+    throw std::runtime_error("Corrupted zap file");
+
+  // Find the first code and first character of each length,
+  // in the same order as BuildTable
+  uint64_t code = 0;
+  size_t index = 0;
+  table.first_code[0] = 0;
+  table.first_index[0] = 0;
+  for (size_t length = 1; length <= kMaxCodeLength; length++) {
+    code = (code + table.count[length - 1]) << 1;
+    index += table.count[length - 1];
+    table.first_code[length] = code;
+    table.first_index[length] = index;
+  }
+
+  // Sort the characters by code length, then by character
+  size_t next_index[kMaxCodeLength + 1];
+  std::copy(table.first_index, table.first_index + kMaxCodeLength + 1,
+            next_index);
+  table.sorted_symbols.resize(num_symbols);
+  for (size_t i = 0; i < lengths.size(); i++) {
+    if (lengths[i] != 0)
+      table.sorted_symbols[next_index[lengths[i]]++] = i;
+  }
+
+  // No need for a wider table than the longest code.
+  // Indices that don't start with a short enough code go bit by bit.
+  table.table_bits = std::min(table.max_length, kDecodeTableBits);
+  DecodeEntry long_code{0, static_cast<uint8_t>(kMaxCodeLength + 1)};
+  table.entries.assign(size_t(1) << table.table_bits, long_code);
+
+  for (size_t length = 1; length <= table.table_bits; length++) {
+    for (size_t i = 0; i < table.count[length]; i++) {
+      // Every index starting with the code leads to its character
+      uint64_t cur_code = table.first_code[length] + i;
+      size_t first = cur_code << (table.table_bits - length);
+      size_t last = (cur_code + 1) << (table.table_bits - length);
+      DecodeEntry entry{table.sorted_symbols[table.first_index[length] + i],
+                        static_cast<uint8_t>(length)};
+      std::fill(table.entries.begin() + first,
+                table.entries.begin() + last, entry);
+    }
+  }
+}
+
+// Objective: Read the bits of one code until it matches a code of its length
+uint8_t Huffman::DecodeBitwise(const DecodeTable& table,
+                               BinaryInputStream& input) {
+  uint64_t code = 0;
+
+  for (size_t length = 1; length <= table.max_length; length++) {
+    code = (code << 1) | input.GetBit();
+    // Codes of this length are count consecutive numbers from first_code
+    if (code - table.first_code[length] < table.count[length])
+      return table.sorted_symbols[table.first_index[length] +
+                                  code - table.first_code[length]];
+  }
+
+  throw std::runtime_error("Corrupted zap file");
+}
+
+// Objective: Resolve up to kDecodeTableBits bits with one lookup
+uint8_t Huffman::DecodeSymbol(const DecodeTable& table,
+                              BinaryInputStream& input) {
+  const DecodeEntry& entry = table.entries[input.PeekBits(table.table_bits)];
+
+  // Codes longer than the table are read again bit by bit
+  if (entry.length > table.table_bits)
+    return DecodeBitwise(table, input);
+
+  input.ConsumeBits(entry.length);
+  return entry.symbol;
+}
+
+// Objective: Write the char to unzap file in the correct sequence,
+//            resolving up to kDecodeTableBits bits per lookup
+uint32_t Huffman::DecodeString(const DecodeTable& table, DecodeMethod method,
+                               BinaryInputStream& input,
+                               BinaryOutputStream& output) {
+  uint32_t num_char = input.GetInt();  // Get the number of char input
+
+  if (method == DecodeMethod::kBitwise) {
+    for (uint32_t i = 0; i < num_char; i++)
+      output.PutChar(DecodeBitwise(table, input));
+    return num_char;
+  }
+
+  for (uint32_t i = 0; i < num_char; i++)
+    output.PutChar(DecodeSymbol(table, input));
+  return num_char;
+}
+
+// Objective: Decode the streams side by side. The streams don't depend on
+//            each other, so the reads of one stream overlap with those of
+//            the others.
+uint32_t Huffman::DecodeInterleaved(BlockDecodeTables& tables,
+                                    DecodeMethod method,
+                                    BinaryInputStream& input,
+                                    BinaryOutputStream& output) {
+  const DecodeTable& table = tables.table;
+  uint32_t num_char = input.GetInt();  // Get the number of char input
+  if (num_char > kMaxBlockSize)
+    throw std::runtime_error("Corrupted zap file");
+
+  input.AlignToByte();
+  uint64_t sizes[kInterleavedStreams];
+  uint64_t total_size = 0;
+  for (uint64_t& size : sizes) {
+    size = static_cast<uint32_t>(input.GetInt());
+    total_size += size;
+  }
+  // No code is longer than 32 bits
+  if (total_size > uint64_t(num_char) * 4 + kInterleavedStreams)
+    throw std::runtime_error("Corrupted zap file");
+
+  std::vector<char>& coded = tables.streams;
+  coded.resize(total_size);
+  input.GetBytes(coded.data(), coded.size());
+  const char *next = coded.data();
+  BinaryInputStream stream0(next, sizes[0]);
+  BinaryInputStream stream1(next += sizes[0], sizes[1]);
+  BinaryInputStream stream2(next += sizes[1], sizes[2]);
+  BinaryInputStream stream3(next += sizes[2], sizes[3]);
+  BinaryInputStream *streams[kInterleavedStreams] = {
+    &stream0, &stream1, &stream2, &stream3
+  };
+
+  std::vector<char>& decoded = tables.decoded;
+  decoded.resize(num_char);
+  uint32_t i = 0;
+  if (method == DecodeMethod::kBitwise) {
+    for (; i < num_char; i++)
+      decoded[i] = DecodeBitwise(table, *streams[i % kInterleavedStreams]);
+  } else {
+    for (; i + kInterleavedStreams <= num_char; i += kInterleavedStreams) {
+      decoded[i] = DecodeSymbol(table, stream0);
+      decoded[i + 1] = DecodeSymbol(table, stream1);
+      decoded[i + 2] = DecodeSymbol(table, stream2);
+      decoded[i + 3] = DecodeSymbol(table, stream3);
+    }
+    for (; i < num_char; i++)
+      decoded[i] = DecodeSymbol(table, *streams[i % kInterleavedStreams]);
+  }
+
+  output.PutBytes(decoded.data(), decoded.size());
+  return num_char;
+}
+
+// Objective: Recreate the huffman tree in preorder
+HuffmanTree Huffman::ReBuildTree(BinaryInputStream& input_stream) {
+  HuffmanTree tree;
+  HelperReBuildTree(input_stream, tree);
+  return tree;
+}
+
+// Objective: Recursive helper method, children come before their parent in
+//            the tree so that the root is the last node
+uint16_t Huffman::HelperReBuildTree(BinaryInputStream& input_stream,
+                                    HuffmanTree& tree) {
+  int cur_bit = input_stream.GetBit();
+  // Create a HuffmanNode with char based on the input binary string
+  if (cur_bit == 1)
+    return tree.AddNode(HuffmanNode(input_stream.GetChar(), 0));
+
+  uint16_t left_subtree = HelperReBuildTree(input_stream, tree);
+  uint16_t right_subtree = HelperReBuildTree(input_stream, tree);
+
+  // Build the parent node
+  return tree.AddNode(HuffmanNode(0, 0, left_subtree, right_subtree));
+}
+
+// Objective: Write the char to unzap file in the correct sequence
+uint32_t Huffman::ReEncodeString(HuffmanTree& tree,
+                                 BinaryInputStream& input,
+                                 BinaryOutputStream& output) {
+  int num_char = input.GetInt();  // Get the number of char input
+  bool cur_bit;
+
+  for (int i = 0; i < num_char; i++) {
+    HuffmanNode* n = &tree.Node(tree.Root());
+    while (!n->IsLeaf()) {
+      cur_bit = input.GetBit();
+      // Go to right if the bit is 1
+      if (cur_bit)
+        n = &tree.Node(n->right());
+      // Go to left if the bit is 0
+      else
+        n = &tree.Node(n->left());
+    }
+    output.PutChar(n->data());
+  }
+  return num_char;
+}
+
+// Objective: Read the group of every context, then the code lengths of every
+//            group into its decoding tables
+void Huffman::ReadContextTables(BinaryInputStream& input,
+                                BlockDecodeTables& tables) {
+  size_t num_groups = input.GetBits(8) + 1;
+
+  size_t group_bits = ContextGroupBits(num_groups);
+  tables.context_group.resize(256);
+  for (size_t ctx = 0; ctx < 256; ctx++) {
+    size_t group = input.GetBits(group_bits);
+    if (group >= num_groups)
+      throw std::runtime_error("Corrupted zap file");
+    tables.context_group[ctx] = group;
+  }
+
+  // Tables of groups unused by this block are kept for the next ones
+  if (tables.group_tables.size() < num_groups)
+    tables.group_tables.resize(num_groups);
+  for (size_t g = 0; g < num_groups; g++) {
+    ReadLengths(input, tables.lengths);
+    BuildDecodeTable(tables.lengths, tables.group_tables[g]);
+  }
+}
+
+// Objective: Decode every character with the table of the character before
+//            it, found without a branch through the table of every context
+uint32_t Huffman::DecodeContext(const BlockDecodeTables& tables,
+                                DecodeMethod method,
+                                BinaryInputStream& input,
+                                BinaryOutputStream& output) {
+  uint32_t num_char = input.GetInt();  // Get the number of char input
+
+  const DecodeTable *context_tables[256];
+  for (size_t ctx = 0; ctx < 256; ctx++)
+    context_tables[ctx] = &tables.group_tables[tables.context_group[ctx]];
+
+  uint8_t prev = 0;
+  if (method == DecodeMethod::kBitwise) {
+    for (uint32_t i = 0; i < num_char; i++) {
+      prev = DecodeBitwise(*context_tables[prev], input);
+      output.PutChar(prev);
+    }
+    return num_char;
+  }
+
+  for (uint32_t i = 0; i < num_char; i++) {
+    prev = DecodeSymbol(*context_tables[prev], input);
+    output.PutChar(prev);
+  }
+  return num_char;
+}
+
+// Objective: Copy the characters straight to the output, a chunk at once
+uint32_t Huffman::CopyStored(BinaryInputStream& input,
+                             BinaryOutputStream& output,
+                             BlockDecodeTables& tables) {
+  uint32_t num_char = input.GetInt();  // Get the number of char input
+  if (num_char > kMaxBlockSize)
+    throw std::runtime_error("Corrupted zap file");
+
+  tables.stored.resize(std::min<size_t>(num_char, kStoredCopySize));
+  for (uint32_t left = num_char; left; ) {
+    size_t size = std::min<size_t>(left, tables.stored.size());
+    input.GetBytes(tables.stored.data(), size);
+    output.PutBytes(tables.stored.data(), size);
+    left -= size;
+  }
+  return num_char;
+}
+
+// Objective: Decode characters, updating the code after each of them, until
+//            the end symbol
+uint64_t Huffman::DecodeAdaptive(BinaryInputStream& input,
+                                 BinaryOutputStream& output) {
+  AdaptiveHuffmanTree tree;
+  uint64_t num_char = 0;
+
+  for (int symbol = tree.Decode(input);
+       symbol != AdaptiveHuffmanTree::kEndSymbol;
+       symbol = tree.Decode(input)) {
+    output.PutChar(symbol);
+    num_char++;
+  }
+  return num_char;
+}
+
+// Objective: Decode a block, its type already read
+uint64_t Huffman::DecompressBlock(uint8_t type, DecodeMethod method,
+                                  BinaryInputStream& input,
+                                  BinaryOutputStream& output,
+                                  BlockDecodeTables& tables, Stats *stats) {
+  if (type > kBlockStored)
+    throw std::runtime_error("Corrupted zap file");
+  if (stats)
+    stats->blocks[type]++;
+
+  PhaseTimer timer(stats);
+  if (type == kBlockStored) {
+    uint32_t num_char = CopyStored(input, output, tables);
+    timer.Lap(&Stats::decode_seconds);
+    if (stats)
+      stats->symbols += num_char;
+    return num_char;
+  }
+
+  if (type == kBlockAdaptive) {
+    uint64_t num_char = DecodeAdaptive(input, output);
+    timer.Lap(&Stats::decode_seconds);
+    if (stats)
+      stats->symbols += num_char;
+    return num_char;
+  }
+
+  if (type == kBlockContext) {
+    ReadContextTables(input, tables);
+  } else if (type == kBlockShared || type == kBlockSharedInterleaved) {
+    uint32_t id = input.GetInt();
+    if (!tables.shared)
+      throw std::runtime_error("Zap file needs a shared table");
+    if (id != tables.shared->id)
+      throw std::runtime_error("Zap file needs a different shared table");
+
+    // Blocks coded with the shared table build its decoding tables once
+    if (!tables.table_is_shared) {
+      tables.lengths = tables.shared->lengths;
+      BuildDecodeTable(tables.lengths, tables.table);
+      tables.table_is_shared = true;
+    }
+  } else {
+    ReadLengths(input, tables.lengths);
+    BuildDecodeTable(tables.lengths, tables.table);
+    tables.table_is_shared = false;
+  }
+  timer.Lap(&Stats::table_seconds);
+
+  uint32_t num_char;
+  if (type == kBlockContext)
+    num_char = DecodeContext(tables, method, input, output);
+  else if (type == kBlockHuffmanInterleaved ||
+           type == kBlockSharedInterleaved)
+    num_char = DecodeInterleaved(tables, method, input, output);
+  else
+    num_char = DecodeString(tables.table, method, input, output);
+  timer.Lap(&Stats::decode_seconds);
+
+  if (stats)
+    stats->symbols += num_char;
+  return num_char;
+}
+
+// Objective: Return the number of bytes written by OutputIndex
+size_t Huffman::IndexSize(const std::vector<BlockIndexEntry>& index) {
+  if (index.size() <= 1)
+    return 0;
+  return index.size() * kIndexEntrySize + kIndexTrailerSize;
+}
+
+// Objective: Write the offset and size of every block, so that blocks can
+//            be found without decoding the ones before
+void Huffman::OutputIndex(std::vector<BlockIndexEntry>& index,
+                          BinaryOutputStream& output) {
+  if (!IndexSize(index))
+    return;
+
+  for (const BlockIndexEntry& entry : index) {
+    output.PutInt(entry.offset >> 32);
+    output.PutInt(entry.offset);
+    output.PutInt(entry.size);
+  }
+  output.PutInt(index.size());
+  output.PutInt(kIndexMagic);
+}
+
+// Objective: Read the trailer at the end of the zap file
+bool Huffman::ReadTrailer(const char *trailer, uint64_t file_size,
+                          uint64_t& num_blocks, uint64_t& blocks_end) {
+  if (file_size < kHeaderSize + 1 + kIndexTrailerSize)
+    return false;
+
+  BinaryInputStream input(trailer, kIndexTrailerSize);
+  num_blocks = static_cast<uint32_t>(input.GetInt());
+  if (static_cast<uint32_t>(input.GetInt()) != kIndexMagic)
+    return false;
+
+  // The end block comes right before the index
+  uint64_t index_size = num_blocks * kIndexEntrySize + kIndexTrailerSize;
+  if (file_size < kHeaderSize + 1 + index_size)
+    return false;
+  blocks_end = file_size - index_size - 1;
+
+  // Adaptive blocks are left out of the index
+  return num_blocks || blocks_end == kHeaderSize;
+}
+
+// Objective: Read the entries of the index, and add the end of the blocks
+void Huffman::ParseIndex(const char *data, uint64_t num_blocks,
+                         uint64_t blocks_end,
+                         std::vector<BlockIndexEntry>& index) {
+  BinaryInputStream input(data, num_blocks * kIndexEntrySize);
+
+  index.clear();
+  for (uint64_t i = 0; i < num_blocks; i++) {
+    uint64_t offset = static_cast<uint32_t>(input.GetInt());
+    offset = (offset << 32) | static_cast<uint32_t>(input.GetInt());
+    uint32_t size = input.GetInt();
+
+    // Blocks follow each other
+    if (offset < (i ? index.back().offset + 1 : kHeaderSize) ||
+        offset >= blocks_end)
+      throw std::runtime_error("Corrupted zap file");
+    index.push_back(BlockIndexEntry{offset, size});
+  }
+  index.push_back(BlockIndexEntry{blocks_end, 0});
+}
+
+// Objective: Read the index from the end of the zap file
+bool Huffman::ReadIndex(std::ifstream &ifs, std::streampos start,
+                        std::vector<BlockIndexEntry>& index) {
+  if (start == std::streampos(-1))
+    return false;
+
+  ifs.clear();
+  if (!ifs.seekg(0, std::ios::end))
+    return false;
+  uint64_t file_size = static_cast<uint64_t>(ifs.tellg() - start);
+
+  // The trailer gives the size of the index
+  char trailer[kIndexTrailerSize];
+  uint64_t num_blocks, blocks_end;
+  if (file_size < kIndexTrailerSize ||
+      !ifs.seekg(-static_cast<std::streamoff>(kIndexTrailerSize),
+                 std::ios::end) ||
+      !ifs.read(trailer, kIndexTrailerSize) ||
+      !ReadTrailer(trailer, file_size, num_blocks, blocks_end))
+    return false;
+
+  std::string entries(num_blocks * kIndexEntrySize, 0);
+  ifs.seekg(start + static_cast<std::streamoff>(blocks_end + 1));
+  if (!ifs.read(&entries[0], entries.size()))
+    return false;
+
+  ParseIndex(entries.data(), num_blocks, blocks_end, index);
+  return true;
+}
+
+bool Huffman::ReadIndex(const char *data, size_t size,
+                        std::vector<BlockIndexEntry>& index) {
+  uint64_t num_blocks, blocks_end;
+  if (size < kIndexTrailerSize ||
+      !ReadTrailer(data + size - kIndexTrailerSize, size,
+                   num_blocks, blocks_end))
+    return false;
+
+  ParseIndex(data + blocks_end + 1, num_blocks, blocks_end, index);
+  return true;
+}
+
+// Objective: Add up the sizes of the blocks until the one holding offset
+size_t Huffman::FindBlock(std::vector<BlockIndexEntry>& index,
+                          uint64_t offset, uint64_t& block_offset) {
+  size_t block = 0;
+
+  block_offset = 0;
+  while (block + 1 < index.size() &&
+         block_offset + index[block].size <= offset)
+    block_offset += index[block++].size;
+
+  return block;
+}
+
+// Objective: Decode the blocks at once into memory, and write them in order
+void Huffman::DecompressBlocks(std::vector<BlockData>& blocks,
+                               const BlockIndexEntry *entries,
+                               const DecompressOptions &options,
+                               std::vector<std::string>& decoded_blocks,
+                               uint64_t& skip, uint64_t& length,
+                               std::ostream &os) {
+  decoded_blocks.resize(std::max(decoded_blocks.size(), blocks.size()));
+
+  // Blocks are measured on their own, then added in order
+  std::vector<Stats> block_stats(options.stats ? blocks.size() : 0);
+  ParallelFor(blocks.size(), options.threads, [&](size_t i) {
+    std::ostringstream decoded(std::ios::out | std::ios::binary);
+    {
+      BinaryInputStream input(blocks[i].data, blocks[i].size);
+      BinaryOutputStream output(decoded);
+      BlockDecodeTables tables;
+      tables.shared = options.table;
+      DecompressBlock(input.GetChar(), options.method, input, output, tables,
+                      options.stats ? &block_stats[i] : nullptr);
+    }
+    decoded_blocks[i] = decoded.str();
+    if (decoded_blocks[i].size() != entries[i].size)
+      throw std::runtime_error("Corrupted zap file");
+  });
+
+  // Only write the requested characters
+  PhaseTimer timer(options.stats);
+  uint64_t written = 0;
+  for (size_t i = 0; i < blocks.size() && length; i++) {
+    const std::string& decoded = decoded_blocks[i];
+    uint64_t begin = std::min<uint64_t>(skip, decoded.size());
+    uint64_t size = std::min<uint64_t>(decoded.size() - begin, length);
+    os.write(decoded.data() + begin, size);
+    skip -= begin;
+    length -= size;
+    written += size;
+  }
+  timer.Lap(&Stats::write_seconds);
+
+  for (const Stats& measured : block_stats)
+    AddStats(measured, *options.stats);
+  if (options.stats)
+    options.stats->bytes_out += written;
+}
+
+// Objective: Read as many blocks as threads, and decode them at once
+void Huffman::DecompressParallel(std::ifstream &ifs, std::streampos start,
+                                 std::vector<BlockIndexEntry>& index,
+                                 size_t first, size_t last,
+                                 uint64_t skip, uint64_t length,
+                                 const DecompressOptions &options,
+                                 std::ofstream &ofs) {
+  std::vector<std::string> coded_blocks(options.threads);
+  std::vector<std::string> decoded_blocks;
+  std::vector<BlockData> blocks;
+
+  ifs.clear();
+  ifs.seekg(start + static_cast<std::streamoff>(index[first].offset));
+  for (size_t block = first; block < last && length;
+       block += options.threads) {
+    size_t count = std::min(options.threads, last - block);
+
+    // Blocks are stored one after the other
+    PhaseTimer timer(options.stats);
+    blocks.clear();
+    for (size_t i = 0; i < count; i++) {
+      std::string& coded = coded_blocks[i];
+      coded.resize(index[block + i + 1].offset - index[block + i].offset);
+      if (!ifs.read(&coded[0], coded.size()))
+        throw std::runtime_error("Corrupted zap file");
+      blocks.push_back(BlockData{coded.data(), coded.size()});
+    }
+    timer.Lap(&Stats::read_seconds);
+
+    DecompressBlocks(blocks, &index[block], options, decoded_blocks,
+                     skip, length, ofs);
+  }
+}
+
+void Huffman::DecompressParallel(const char *data,
+                                 std::vector<BlockIndexEntry>& index,
+                                 size_t first, size_t last,
+                                 uint64_t skip, uint64_t length,
+                                 const DecompressOptions &options,
+                                 std::ostream &os) {
+  std::vector<std::string> decoded_blocks;
+  std::vector<BlockData> blocks;
+
+  for (size_t block = first; block < last && length;
+       block += options.threads) {
+    size_t count = std::min(options.threads, last - block);
+
+    // Decode the blocks in place
+    blocks.clear();
+    for (size_t i = block; i < block + count; i++)
+      blocks.push_back(BlockData{data + index[i].offset,
+                                 index[i + 1].offset - index[i].offset});
+
+    DecompressBlocks(blocks, &index[block], options, decoded_blocks,
+                     skip, length, os);
+  }
+}
+
+void Huffman::DecompressRange(std::ifstream &ifs, std::ofstream &ofs,
+                              uint64_t offset, uint64_t length) {
+  DecompressRange(ifs, ofs, offset, length, DecompressOptions());
+}
+
+void Huffman::DecompressRange(std::ifstream &ifs, std::ofstream &ofs,
+                              uint64_t offset, uint64_t length,
+                              const DecompressOptions &options) {
+  if (options.threads == 0)
+    throw std::invalid_argument("Number of threads out of range");
+
+  PhaseTimer total(options.stats);
+  std::vector<BlockIndexEntry> index;
+  std::streampos start = ifs.tellg();
+  if (ReadIndex(ifs, start, index)) {
+    uint64_t block_offset;
+    size_t first = FindBlock(index, offset, block_offset);
+    DecompressParallel(ifs, start, index, first, index.size() - 1,
+                       offset - block_offset, length, options, ofs);
+  } else {
+    // Looking for the index may have moved a file away from the header
+    if (start != std::streampos(-1)) {
+      ifs.clear();
+      ifs.seekg(start);
+    }
+    BinaryInputStream input_stream(ifs);
+    BlockDecodeTables tables;
+    tables.shared = options.table;
+    RangeOutputBuffer range(ofs, offset, length);
+    std::ostream os(&range);
+    DecompressStream(input_stream, options.method, os, tables,
+                     options.stats);
+  }
+
+  if (options.stats)
+    options.stats->bytes_in += StreamSize(ifs, start);
+  total.Finish();
+}
+
+void Huffman::DecompressRange(const char *data, size_t size,
+                              std::ostream &os,
+                              uint64_t offset, uint64_t length,
+                              const DecompressOptions &options) {
+  if (options.threads == 0)
+    throw std::invalid_argument("Number of threads out of range");
+
+  PhaseTimer total(options.stats);
+  std::vector<BlockIndexEntry> index;
+  if (ReadIndex(data, size, index)) {
+    uint64_t block_offset;
+    size_t first = FindBlock(index, offset, block_offset);
+    DecompressParallel(data, index, first, index.size() - 1,
+                       offset - block_offset, length, options, os);
+  } else {
+    BinaryInputStream input_stream(data, size);
+    BlockDecodeTables tables;
+    tables.shared = options.table;
+    RangeOutputBuffer range(os, offset, length);
+    std::ostream range_os(&range);
+    DecompressStream(input_stream, options.method, range_os, tables,
+                     options.stats);
+  }
+
+  if (options.stats)
+    options.stats->bytes_in += size;
+  total.Finish();
+}
+
+// Objective: Check the magic bytes and the version, without consuming them
+bool Huffman::HasIndex(BinaryInputStream& input) {
+  uint32_t header = input.PeekBits(32);
+  return (header >> 8) == kMagic && (header & 0xff) >= 3;
+}
+
+// Objective: Decode the zap file one block after the other
+void Huffman::DecompressStream(BinaryInputStream& input_stream,
+                               DecodeMethod method, std::ostream &os,
+                               BlockDecodeTables& tables, Stats *stats) {
+  BinaryOutputStream output_stream(os);
+  uint64_t written = 0;
+
+  // Unversioned files start directly with the tree
+  if (input_stream.PeekBits(24) != kMagic) {
+    PhaseTimer timer(stats);
+    HuffmanTree tree = ReBuildTree(input_stream);
+    timer.Lap(&Stats::table_seconds);
+    written = ReEncodeString(tree, input_stream, output_stream);
+    timer.Lap(&Stats::decode_seconds);
+    if (stats) {
+      stats->symbols += written;
+      stats->bytes_out += written;
+    }
+    return;
+  }
+
+  input_stream.ConsumeBits(24);
+  uint8_t version = input_stream.GetChar();
+  if (version < 1 || version > kFormatVersion)
+    throw std::runtime_error("Unsupported zap file version");
+
+  // Version 1 files are a single block without type
+  if (version == 1) {
+    written = DecompressBlock(kBlockHuffman, method, input_stream,
+                              output_stream, tables, stats);
+  } else {
+    // Decode every block until the end block
+    for (;;) {
+      uint8_t type = input_stream.GetChar();
+      if (type == kBlockEnd)
+        break;
+
+      written += DecompressBlock(type, method, input_stream, output_stream,
+                                 tables, stats);
+      input_stream.AlignToByte();
+    }
+  }
+
+  if (stats)
+    stats->bytes_out += written;
+}
+
+void Huffman::Compress(const char *data, size_t size, std::string &out,
+                       const CompressOptions &options) {
+  out.clear();
+  StringOutputBuffer buffer(out);
+  std::ostream os(&buffer);
+  Compress(data, size, os, options);
+}
+
+void Huffman::Decompress(std::ifstream &ifs, std::ofstream &ofs,
+                         DecodeMethod method) {
+  DecompressOptions options;
+  options.method = method;
+  Decompress(ifs, ofs, options);
+}
+
+void Huffman::Decompress(std::ifstream &ifs, std::ofstream &ofs,
+                         const DecompressOptions &options) {
+  if (options.threads == 0)
+    throw std::invalid_argument("Number of threads out of range");
+
+  PhaseTimer total(options.stats);
+  std::streampos start = ifs.tellg();
+  BinaryInputStream input_stream(ifs);
+
+  // With an index, blocks can be decoded at once
+  std::vector<BlockIndexEntry> index;
+  BlockDecodeTables tables;
+  tables.shared = options.table;
+  bool has_index = options.threads > 1 && HasIndex(input_stream);
+  if (has_index && ReadIndex(ifs, start, index)) {
+    DecompressParallel(ifs, start, index, 0, index.size() - 1,
+                       0, UINT64_MAX, options, ofs);
+  } else if (has_index && start != std::streampos(-1)) {
+    // Looking for the index moved the file past the bytes input_stream
+    // holds, e.g. of adaptive blocks which aren't in the index. The stream
+    // starts over from the header.
+    ifs.clear();
+    ifs.seekg(start);
+    BinaryInputStream restarted(ifs);
+    DecompressStream(restarted, options.method, ofs, tables, options.stats);
+  } else {
+    DecompressStream(input_stream, options.method, ofs, tables,
+                     options.stats);
+  }
+
+  if (options.stats)
+    options.stats->bytes_in += StreamSize(ifs, start);
+  total.Finish();
+}
+
+void Huffman::Decompress(const char *data, size_t size, std::ostream &os,
+                         const DecompressOptions &options) {
+  if (options.threads == 0)
+    throw std::invalid_argument("Number of threads out of range");
+
+  PhaseTimer total(options.stats);
+  BinaryInputStream input_stream(data, size);
+
+  // With an index, blocks can be decoded at once
+  std::vector<BlockIndexEntry> index;
+  BlockDecodeTables tables;
+  tables.shared = options.table;
+  if (options.threads > 1 && HasIndex(input_stream) &&
+      ReadIndex(data, size, index))
+    DecompressParallel(data, index, 0, index.size() - 1,
+                       0, UINT64_MAX, options, os);
+  else
+    DecompressStream(input_stream, options.method, os, tables,
+                     options.stats);
+
+  if (options.stats)
+    options.stats->bytes_in += size;
+  total.Finish();
+}
+
+void Huffman::Decompress(const char *data, size_t size, std::string &out,
+                         const DecompressOptions &options) {
+  out.clear();
+  StringOutputBuffer buffer(out);
+  std::ostream os(&buffer);
+  Decompress(data, size, os, options);
+}
+
+// Compresses messages one after the other with the same options, e.g. the
+// payloads of requests. The tables of the last message and the output
+// string are kept, so that once they have grown for the largest message
+// the following ones are coded without allocating memory. Messages are
+// coded on the calling thread, in blocks of block_size.
+class HuffmanEncoder {
+ public:
+  HuffmanEncoder();
+  explicit HuffmanEncoder(const Huffman::CompressOptions &options);
+
+  // Compress the size bytes at data into out, replacing its contents, as
+  // Huffman::Compress would
+  void Compress(const char *data, size_t size, std::string &out);
+
+ private:
+  Huffman::CompressOptions options;
+  Huffman::BlockEncodeTables tables;
+  std::vector<Huffman::BlockIndexEntry> index;
+};
+
+HuffmanEncoder::HuffmanEncoder()
+    : HuffmanEncoder(Huffman::CompressOptions()) { }
+
+HuffmanEncoder::HuffmanEncoder(const Huffman::CompressOptions &options)
+    : options(options) {
+  Huffman::CheckOptions(options);
+}
+
+// Objective: Write the blocks straight into out one after the other, as
+//            Huffman::Compress does with one thread
+void HuffmanEncoder::Compress(const char *data, size_t size,
+                              std::string &out) {
+  Huffman::PhaseTimer total(options.stats);
+  out.clear();
+  StringOutputBuffer buffer(out);
+  std::ostream os(&buffer);
+  BinaryOutputStream output(os);
+
+  Huffman::OutputHeader(output);
+  index.clear();
+  for (size_t pos = 0; pos < size;) {
+    size_t block_size = std::min(options.block_size, size - pos);
+    index.push_back(Huffman::BlockIndexEntry{
+        buffer.Size(), static_cast<uint32_t>(block_size)});
+    Huffman::CompressBlock(data + pos, block_size, options, output, tables,
+                           options.stats);
+    pos += block_size;
+  }
+
+  output.PutChar(Huffman::kBlockEnd);
+  Huffman::OutputIndex(index, output);
+  output.Close();
+
+  if (options.stats)
+    options.stats->bytes_out += buffer.Size();
+  total.Finish();
+}
+
+// Decompresses messages one after the other, keeping the decoding tables
+// and the output string between them as HuffmanEncoder does. Any zap file
+// can be decoded, on the calling thread.
+class HuffmanDecoder {
+ public:
+  HuffmanDecoder();
+  explicit HuffmanDecoder(const Huffman::DecompressOptions &options);
+
+  // Decompress the zap file of size bytes at data into out, replacing its
+  // contents
+  void Decompress(const char *data, size_t size, std::string &out);
+
+ private:
+  Huffman::DecompressOptions options;
+  Huffman::BlockDecodeTables tables;
+};
+
+HuffmanDecoder::HuffmanDecoder()
+    : HuffmanDecoder(Huffman::DecompressOptions()) { }
+
+HuffmanDecoder::HuffmanDecoder(const Huffman::DecompressOptions &options)
+    : options(options) {
+  tables.shared = options.table;
+}
+
+void HuffmanDecoder::Decompress(const char *data, size_t size,
+                                std::string &out) {
+  Huffman::PhaseTimer total(options.stats);
+  out.clear();
+  {
+    StringOutputBuffer buffer(out);
+    std::ostream os(&buffer);
+    BinaryInputStream input(data, size);
+    Huffman::DecompressStream(input, options.method, os, tables,
+                              options.stats);
+  }
+
+  if (options.stats)
+    options.stats->bytes_in += size;
+  total.Finish();
+}
+
+// Codes a stream of unknown length in one pass, in constant memory, with an
+// AdaptiveHuffmanTree. The output is a zap file holding a kBlockAdaptive
+// block, which Huffman::Decompress reads as any other.
+class AdaptiveHuffmanEncoder {
+ public:
+  // Write the header to os
+  explicit AdaptiveHuffmanEncoder(std::ostream &os);
+  // Finish the stream if it isn't already
+  ~AdaptiveHuffmanEncoder();
+
+  // Code the size characters at data
+  void Write(const char *data, size_t size);
+
+  // Hand the whole bytes coded so far to the output stream, and flush it.
+  // The bits of the last partial byte wait for the next characters.
+  void Flush();
+
+  // Write the end symbol and the end of the zap file, and flush it
+  void Finish();
+
+ private:
+  std::ostream &os;
+  BinaryOutputStream output;
+  AdaptiveHuffmanTree tree;
+  bool finished = false;
+};
+
+AdaptiveHuffmanEncoder::AdaptiveHuffmanEncoder(std::ostream &os)
+    : os(os), output(os) {
+  Huffman::OutputHeader(output);
+  output.PutChar(Huffman::kBlockAdaptive);
+}
+
+AdaptiveHuffmanEncoder::~AdaptiveHuffmanEncoder() {
+  if (!finished)
+    Finish();
+}
+
+void AdaptiveHuffmanEncoder::Write(const char *data, size_t size) {
+  if (finished)
+    throw std::logic_error("Write after the end of the stream");
+
+  for (size_t i = 0; i < size; i++)
+    tree.Encode(static_cast<unsigned char>(data[i]), output);
+}
+
+void AdaptiveHuffmanEncoder::Flush() {
+  os.flush();
+}
+
+// Objective: End the block, then write the end block. The adaptive block
+//            isn't in the index, so there is none.
+void AdaptiveHuffmanEncoder::Finish() {
+  finished = true;
+  tree.Encode(AdaptiveHuffmanTree::kEndSymbol, output);
+  output.AlignToByte();
+  output.PutChar(Huffman::kBlockEnd);
+  output.Close();
+  os.flush();
+}
+
+// Decodes the characters of a zap file written by AdaptiveHuffmanEncoder
+// as they are read, e.g. from a live stream
+class AdaptiveHuffmanDecoder {
+ public:
+  // Read the header from is
+  explicit AdaptiveHuffmanDecoder(std::istream &is);
+
+  // Decode up to size characters into data, and return their number. Fewer
+  // characters are returned only at the end of the stream.
+  size_t Read(char *data, size_t size);
+
+ private:
+  BinaryInputStream input;
+  AdaptiveHuffmanTree tree;
+  bool ended = false;
+};
+
+// Objective: Check the magic bytes, the version and the block type
+AdaptiveHuffmanDecoder::AdaptiveHuffmanDecoder(std::istream &is)
+    : input(is) {
+  uint32_t header = input.GetBits(32);
+  if ((header >> 8) != Huffman::kMagic ||
+      (header & 0xff) < 6 || (header & 0xff) > Huffman::kFormatVersion ||
+      static_cast<uint8_t>(input.GetChar()) != Huffman::kBlockAdaptive)
+    throw std::runtime_error("Not an adaptive zap file");
+}
+
+size_t AdaptiveHuffmanDecoder::Read(char *data, size_t size) {
+  size_t num_char = 0;
+
+  while (num_char < size && !ended) {
+    int symbol = tree.Decode(input);
+    if (symbol == AdaptiveHuffmanTree::kEndSymbol)
+      ended = true;
+    else
+      data[num_char++] = static_cast<char>(symbol);
+  }
+  return num_char;
+}
+
+// Objective: Wait for a character, then take the ones already there, and
+//            hand their codes on before waiting for more
+void Huffman::CompressAdaptive(std::istream &is, std::ostream &os) {
+  AdaptiveHuffmanEncoder encoder(os);
+  std::vector<char> buffer(kAdaptiveReadSize);
+
+  while (is.read(buffer.data(), 1)) {
+    size_t size = 1 + is.readsome(buffer.data() + 1, buffer.size() - 1);
+    encoder.Write(buffer.data(), size);
+    encoder.Flush();
+  }
+  encoder.Finish();
 }
 
 #endif  // HUFFMAN_H_
@@ -0,0 +1,73 @@
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+
+// Read-only memory mapping of a whole file, so that its bytes can be read in
+// place without stream calls or copies
+class MappedFile {
+ public:
+  explicit MappedFile(const char *filename);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // False if the file couldn't be mapped, e.g. it isn't a regular file
+  bool is_open() const { return open_; }
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Tell the kernel how the bytes will be read, e.g. MADV_SEQUENTIAL when
+  // they are read once from the start to the end
+  void Advise(int advice) const;
+
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  bool open_ = false;
+};
+
+MappedFile::MappedFile(const char *filename) {
+  // Opening a FIFO for reading would wait for a writer
+  int fd = open(filename, O_RDONLY | O_NONBLOCK);
+  if (fd < 0)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    size_ = st.st_size;
+
+    // Empty files can't be mapped, but have nothing to read anyway
+    if (!size_) {
+      open_ = true;
+    } else {
+      void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        data_ = static_cast<const char *>(addr);
+        open_ = true;
+      }
+    }
+  }
+
+  // The mapping stays valid once the file is closed
+  close(fd);
+}
+
+void MappedFile::Advise(int advice) const {
+  if (data_)
+    madvise(const_cast<char *>(data_), size_, advice);
+}
+
+MappedFile::~MappedFile() {
+  if (data_)
+    munmap(const_cast<char *>(data_), size_);
+}
+
+#endif  // MAPPED_FILE_H_
@@ -2,30 +2,51 @@
 #define PQUEUE_H_
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
 #include <iostream>
 
-template <typename T, typename C = std::less<T>>
+// Heap of arity D: every node has up to D children. With D above 2 the
+// children of a node are side by side in memory and the heap has fewer
+// levels, for more comparisons per level.
+template <typename T, typename C = std::less<T>, size_t D = 2>
 class PQueue {
+  static_assert(D >= 2, "A heap node needs at least two children");
+
  public:
   // Constructor
   PQueue() {}
+  // Build the priority queue from the items of a range in linear time
+  template <typename InputIt>
+  PQueue(InputIt first, InputIt last);
   // Return number of items in priority queue
   size_t Size();
+  // Make room for n items without reallocation
+  void Reserve(size_t n);
   // Return top of priority queue
   T& Top();
   // Remove top of priority queue
   void Pop();
+  // Remove top of priority queue and return it
+  T PopTop();
   // Insert item and sort priority queue
   void Push(const T &item);
+  void Push(T &&item);
+  // Insert an item built from args in place
+  template <typename... Args>
+  void Emplace(Args&&... args);
 
  private:
   std::vector<T> items;
-  size_t cur_size = 0;
   C cmp;
 
   // Helper methods for indices
@@ -33,13 +54,10 @@ class PQueue {
     return 0;
   }
   size_t Parent(size_t n) {
-    return (n - 1) / 2;
-  }
-  size_t LeftChild(size_t n) {
-    return 2 * n + 1;
+    return (n - 1) / D;
   }
-  size_t RightChild(size_t n) {
-    return 2 * n + 2;
+  size_t FirstChild(size_t n) {
+    return D * n + 1;
   }
 
   // Helper methods for node testing
@@ -47,15 +65,115 @@ class PQueue {
     return n != Root();
   }
   bool IsNode(size_t n) {
-    return n < cur_size;
+    return n < items.size();
+  }
+
+  // Helper methods for restructuring
+  void PercolateUp(size_t n);
+  void PercolateDown(size_t n);
+  void Heapify();
+};
+
+// Priority queue whose items can be changed or removed while queued. Push
+// returns a handle to the item, which stays valid until the item leaves
+// the queue; handles are then reused.
+template <typename T, typename C = std::less<T>, size_t D = 2>
+class IndexedPQueue {
+  static_assert(D >= 2, "A heap node needs at least two children");
+
+ public:
+  typedef size_t Handle;
+
+  // Constructor
+  IndexedPQueue() {}
+  // Return number of items in priority queue
+  size_t Size();
+  // Return true if the item of handle is in the priority queue
+  bool Contains(Handle handle);
+  // Return the item of handle
+  const T& Get(Handle handle);
+  // Return top of priority queue and its handle
+  const T& Top();
+  Handle TopHandle();
+  // Remove top of priority queue
+  void Pop();
+  // Remove top of priority queue and return it
+  T PopTop();
+  // Insert item and return its handle
+  Handle Push(const T &item);
+  Handle Push(T &&item);
+  // Replace the item of handle, e.g. to change its priority
+  void Update(Handle handle, const T &item);
+  void Update(Handle handle, T &&item);
+  // Remove the item of handle
+  void Erase(Handle handle);
+
+ private:
+  // Position in the heap of the removed items
+  static const size_t kNotQueued = static_cast<size_t>(-1);
+
+  std::vector<T> items;
+  // Handle of the item at each position of the heap
+  std::vector<Handle> handles;
+  // Position in the heap of the item of each handle
+  std::vector<size_t> positions;
+  // Handles of the removed items
+  std::vector<Handle> free_handles;
+  C cmp;
+
+  // Helper methods for indices
+  size_t Parent(size_t n) {
+    return (n - 1) / D;
+  }
+  size_t FirstChild(size_t n) {
+    return D * n + 1;
   }
 
   // Helper methods for restructuring
+  Handle NewHandle();
+  void Place(size_t n, T &&item, Handle handle);
+  void Remove(size_t n);
+  void Restore(size_t n);
   void PercolateUp(size_t n);
   void PercolateDown(size_t n);
+};
+
+// Priority queue shared between threads, made of several sub-heaps each
+// behind its own lock (MultiQueue). Push goes to a random sub-heap, and Pop
+// takes the better top of two random sub-heaps, so threads rarely wait for
+// each other. Ordering is relaxed: the item popped is among the best ones,
+// but not always the best one. With a single sub-heap it is exact.
+template <typename T, typename C = std::less<T>, size_t D = 2>
+class ConcurrentPQueue {
+  static_assert(D >= 2, "A heap node needs at least two children");
+
+ public:
+  // Constructor, 0 sub-heaps picks twice as many as hardware threads
+  explicit ConcurrentPQueue(size_t num_queues = 0);
+  // Return number of items in priority queue, which may already have
+  // changed when used
+  size_t Size();
+  // Insert item
+  void Push(const T &item);
+  void Push(T &&item);
+  // Remove one of the top items into item, return false if the queue is
+  // empty
+  bool TryPop(T &item);
+
+ private:
+  // Sub-heap and its lock, padded so that two locks never share a cache line
+  struct SubQueue {
+    std::mutex mutex;
+    PQueue<T, C, D> heap;
+    char padding[64];
+  };
+
+  std::vector<std::unique_ptr<SubQueue>> queues;
+  std::atomic<size_t> size{0};
+  C cmp;
 
-  // Node comparison
-  bool CompareNodes(size_t i, size_t j);
+  // Helper methods
+  size_t RandomQueue();
 };
 
 //
@@ -67,7 +185,7 @@ class PQueue {
 template<typename T>
 class MyClassPtrCompMin {
  public:
-  bool operator()(T lhs, T rhs) const {
+  bool operator()(const T &lhs, const T &rhs) const {
     return *lhs < *rhs;
   }
 };
@@ -78,7 +196,7 @@ class MyClassPtrCompMin {
 template<typename T>
 class MyClassPtrCompMax {
  public:
-  bool operator()(T lhs, T rhs) const {
+  bool operator()(const T &lhs, const T &rhs) const {
     return *lhs > *rhs;
   }
 };
@@ -87,15 +205,28 @@ class MyClassPtrCompMax {
 // Public API
 //
 
+// Build priority queue from a range
+template <typename T, typename C, size_t D>
+template <typename InputIt>
+PQueue<T, C, D>::PQueue(InputIt first, InputIt last) : items(first, last) {
+  Heapify();
+}
+
 // Return number of items in priority queue
-template <typename T, typename C>
-size_t PQueue<T, C>::Size() {
-  return cur_size;
+template <typename T, typename C, size_t D>
+size_t PQueue<T, C, D>::Size() {
+  return items.size();
+}
+
+// Make room for n items
+template <typename T, typename C, size_t D>
+void PQueue<T, C, D>::Reserve(size_t n) {
+  items.reserve(n);
 }
 
 // Return top of priority queue
-template <typename T, typename C>
-T& PQueue<T, C>::Top() {
+template <typename T, typename C, size_t D>
+T& PQueue<T, C, D>::Top() {
     // Throw error if the pqueue is empty
     if (!Size())
       throw std::underflow_error("Empty priority queue!");
@@ -103,29 +234,55 @@ T& PQueue<T, C>::Top() {
 }
 
 // Remove top of priority queue
-template <typename T, typename C>
-void PQueue<T, C>::Pop() {
+template <typename T, typename C, size_t D>
+void PQueue<T, C, D>::Pop() {
     // Throw error if the pqueue is empty
     if (!Size())
         throw std::underflow_error("Empty priority queue!");
 
     // Move last item to the root and reduce the heap size
-    items[Root()] = std::move(items[cur_size - 1]);
-    cur_size--;
+    if (Size() > 1)
+      items[Root()] = std::move(items.back());
     items.pop_back();
     // Percolate the item (currently at root) down the pqueue
-    PercolateDown(Root());
+    if (Size())
+      PercolateDown(Root());
   }
 
+// Remove top of priority queue and return it, moved out of the queue
+template <typename T, typename C, size_t D>
+T PQueue<T, C, D>::PopTop() {
+  // Throw error if the pqueue is empty
+  if (!Size())
+    throw std::underflow_error("Empty priority queue!");
+
+  T top = std::move(items[Root()]);
+  Pop();
+  return top;
+}
+
 // Insert item and sort priority queue
-template <typename T, typename C>
-void PQueue<T, C>::Push(const T &item) {
-  // Insert into the underlying vector
+template <typename T, typename C, size_t D>
+void PQueue<T, C, D>::Push(const T &item) {
+  // Insert at the end of the underlying vector
   items.push_back(item);
-  // Insert at the end
-  items[++cur_size] = std::move(item);
   // Percolate up
-  PercolateUp(cur_size - 1);
+  PercolateUp(Size() - 1);
+}
+
+// Insert item, moved into the priority queue
+template <typename T, typename C, size_t D>
+void PQueue<T, C, D>::Push(T &&item) {
+  items.push_back(std::move(item));
+  PercolateUp(Size() - 1);
+}
+
+// Insert an item constructed from args at the end, then percolate it up
+template <typename T, typename C, size_t D>
+template <typename... Args>
+void PQueue<T, C, D>::Emplace(Args&&... args) {
+  items.emplace_back(std::forward<Args>(args)...);
+  PercolateUp(Size() - 1);
 }
 
 //
@@ -133,44 +290,349 @@ void PQueue<T, C>::Push(const T &item) {
 //
 
 // Helper methods for restructuring
-template <typename T, typename C>
-void PQueue<T, C>::PercolateUp(size_t n) {
+template <typename T, typename C, size_t D>
+void PQueue<T, C, D>::PercolateUp(size_t n) {
   // Iterate until n is root
-  // If parent node is less(min) or greater(max) than current node
-  // swap the parent and current node, and continue with the parent node
-  while (HasParent(n) && CompareNodes(n, Parent(n))) {
-    std::swap(items[Parent(n)], items[n]);
+  // If parent node is less(min) or greater(max) than the item, move the
+  // parent down to n, and continue with the parent node. The item is only
+  // moved once to its place.
+  if (!HasParent(n) || !cmp(items[n], items[Parent(n)]))
+    return;
+
+  T item = std::move(items[n]);
+  do {
+    items[n] = std::move(items[Parent(n)]);
     n = Parent(n);
-  }
+  } while (HasParent(n) && cmp(item, items[Parent(n)]));
+  items[n] = std::move(item);
 }
 
 // Helper methods for restructuring
-template <typename T, typename C>
-void PQueue<T, C>::PercolateDown(size_t n) {
+template <typename T, typename C, size_t D>
+void PQueue<T, C, D>::PercolateDown(size_t n) {
+  T item = std::move(items[n]);
+
   // While node has at least one child
-  while (IsNode(LeftChild(n))) {
-    // Consider the left child by default
-    size_t child = LeftChild(n);
-    // If the right child exists and smaller than left child,
-    // then consider right child
-    if (IsNode(RightChild(n)) && CompareNodes(RightChild(n), LeftChild(n)))
-      child = RightChild(n);
-
-    // Exchange the smallest child with node to restore heap-order if necessary
-    if (CompareNodes(child, n))
-      std::swap(items[child], items[n]);
-    else
+  while (IsNode(FirstChild(n))) {
+    // Consider the first child by default, then the smallest of the others
+    size_t child = FirstChild(n);
+    size_t last = std::min(FirstChild(n) + D, Size());
+    for (size_t i = child + 1; i < last; i++) {
+      if (cmp(items[i], items[child]))
+        child = i;
+    }
+
+    // Move the smallest child up to restore heap-order if necessary
+    if (!cmp(items[child], item))
       break;
+    items[n] = std::move(items[child]);
 
     // Do it again
     n = child;
   }
+
+  items[n] = std::move(item);
+}
+
+// Restore heap-order from the last parent up to the root, in linear time
+template <typename T, typename C, size_t D>
+void PQueue<T, C, D>::Heapify() {
+  if (Size() < 2)
+    return;
+
+  for (size_t n = Parent(Size() - 1) + 1; n-- > 0;)
+    PercolateDown(n);
+}
+
+
+//
+// Indexed priority queue
+//
+
+template <typename T, typename C, size_t D>
+const size_t IndexedPQueue<T, C, D>::kNotQueued;
+
+// Return number of items in priority queue
+template <typename T, typename C, size_t D>
+size_t IndexedPQueue<T, C, D>::Size() {
+  return items.size();
+}
+
+// Check that the handle was given out and its item is still queued
+template <typename T, typename C, size_t D>
+bool IndexedPQueue<T, C, D>::Contains(Handle handle) {
+  return handle < positions.size() && positions[handle] != kNotQueued;
+}
+
+// Return the item of handle
+template <typename T, typename C, size_t D>
+const T& IndexedPQueue<T, C, D>::Get(Handle handle) {
+  if (!Contains(handle))
+    throw std::out_of_range("No such item in priority queue!");
+  return items[positions[handle]];
+}
+
+// Return top of priority queue
+template <typename T, typename C, size_t D>
+const T& IndexedPQueue<T, C, D>::Top() {
+  // Throw error if the pqueue is empty
+  if (!Size())
+    throw std::underflow_error("Empty priority queue!");
+  return items[0];
+}
+
+// Return the handle of the top of priority queue
+template <typename T, typename C, size_t D>
+typename IndexedPQueue<T, C, D>::Handle IndexedPQueue<T, C, D>::TopHandle() {
+  // Throw error if the pqueue is empty
+  if (!Size())
+    throw std::underflow_error("Empty priority queue!");
+  return handles[0];
+}
+
+// Remove top of priority queue
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::Pop() {
+  // Throw error if the pqueue is empty
+  if (!Size())
+    throw std::underflow_error("Empty priority queue!");
+  Remove(0);
+}
+
+// Remove top of priority queue and return it, moved out of the queue
+template <typename T, typename C, size_t D>
+T IndexedPQueue<T, C, D>::PopTop() {
+  // Throw error if the pqueue is empty
+  if (!Size())
+    throw std::underflow_error("Empty priority queue!");
+
+  T top = std::move(items[0]);
+  Remove(0);
+  return top;
+}
+
+// Insert item at the end and percolate it up
+template <typename T, typename C, size_t D>
+typename IndexedPQueue<T, C, D>::Handle
+IndexedPQueue<T, C, D>::Push(const T &item) {
+  return Push(T(item));
+}
+
+template <typename T, typename C, size_t D>
+typename IndexedPQueue<T, C, D>::Handle
+IndexedPQueue<T, C, D>::Push(T &&item) {
+  Handle handle = NewHandle();
+
+  items.push_back(std::move(item));
+  handles.push_back(handle);
+  positions[handle] = Size() - 1;
+  PercolateUp(Size() - 1);
+  return handle;
+}
+
+// Replace the item, and move it up or down depending on its new priority
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::Update(Handle handle, const T &item) {
+  Update(handle, T(item));
+}
+
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::Update(Handle handle, T &&item) {
+  if (!Contains(handle))
+    throw std::out_of_range("No such item in priority queue!");
+
+  size_t n = positions[handle];
+  items[n] = std::move(item);
+  Restore(n);
+}
+
+// Remove the item of handle wherever it is in the heap
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::Erase(Handle handle) {
+  if (!Contains(handle))
+    throw std::out_of_range("No such item in priority queue!");
+  Remove(positions[handle]);
+}
+
+//
+// Private Methods
+//
+
+// Reuse the handle of a removed item if there is one
+template <typename T, typename C, size_t D>
+typename IndexedPQueue<T, C, D>::Handle IndexedPQueue<T, C, D>::NewHandle() {
+  if (free_handles.empty()) {
+    positions.push_back(kNotQueued);
+    return positions.size() - 1;
+  }
+
+  Handle handle = free_handles.back();
+  free_handles.pop_back();
+  return handle;
+}
+
+// Put the item of handle at position n of the heap
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::Place(size_t n, T &&item, Handle handle) {
+  items[n] = std::move(item);
+  handles[n] = handle;
+  positions[handle] = n;
+}
+
+// Replace the item at position n by the last item, and restore heap-order
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::Remove(size_t n) {
+  Handle handle = handles[n];
+  positions[handle] = kNotQueued;
+  free_handles.push_back(handle);
+
+  size_t last = Size() - 1;
+  if (n != last)
+    Place(n, std::move(items[last]), handles[last]);
+  items.pop_back();
+  handles.pop_back();
+
+  if (n < Size())
+    Restore(n);
+}
+
+// Move the item at position n up or down to its place
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::Restore(size_t n) {
+  if (n > 0 && cmp(items[n], items[Parent(n)]))
+    PercolateUp(n);
+  else
+    PercolateDown(n);
+}
+
+// Move parents down until the item at position n is in heap-order
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::PercolateUp(size_t n) {
+  if (n == 0 || !cmp(items[n], items[Parent(n)]))
+    return;
+
+  T item = std::move(items[n]);
+  Handle handle = handles[n];
+  do {
+    Place(n, std::move(items[Parent(n)]), handles[Parent(n)]);
+    n = Parent(n);
+  } while (n > 0 && cmp(item, items[Parent(n)]));
+  Place(n, std::move(item), handle);
+}
+
+// Move the smallest children up until the item at position n is in
+// heap-order
+template <typename T, typename C, size_t D>
+void IndexedPQueue<T, C, D>::PercolateDown(size_t n) {
+  T item = std::move(items[n]);
+  Handle handle = handles[n];
+
+  while (FirstChild(n) < Size()) {
+    size_t child = FirstChild(n);
+    size_t last = std::min(FirstChild(n) + D, Size());
+    for (size_t i = child + 1; i < last; i++) {
+      if (cmp(items[i], items[child]))
+        child = i;
+    }
+
+    if (!cmp(items[child], item))
+      break;
+    Place(n, std::move(items[child]), handles[child]);
+    n = child;
+  }
+
+  Place(n, std::move(item), handle);
+}
+
+
+//
+// Concurrent priority queue
+//
+
+// Create the sub-heaps
+template <typename T, typename C, size_t D>
+ConcurrentPQueue<T, C, D>::ConcurrentPQueue(size_t num_queues) {
+  if (!num_queues)
+    num_queues = 2 * std::max(1u, std::thread::hardware_concurrency());
+
+  for (size_t i = 0; i < num_queues; i++)
+    queues.emplace_back(new SubQueue());
+}
+
+// Return number of items in priority queue
+template <typename T, typename C, size_t D>
+size_t ConcurrentPQueue<T, C, D>::Size() {
+  return size.load();
+}
+
+// Insert item into the first random sub-heap that isn't locked. After as
+// many tries as there are sub-heaps, wait for the lock of a random one
+// rather than spinning.
+template <typename T, typename C, size_t D>
+void ConcurrentPQueue<T, C, D>::Push(const T &item) {
+  Push(T(item));
+}
+
+template <typename T, typename C, size_t D>
+void ConcurrentPQueue<T, C, D>::Push(T &&item) {
+  std::unique_lock<std::mutex> lock;
+  SubQueue *queue = nullptr;
+  for (size_t tries = 0; tries < queues.size() && !lock; tries++) {
+    queue = queues[RandomQueue()].get();
+    lock = std::unique_lock<std::mutex>(queue->mutex, std::try_to_lock);
+  }
+  if (!lock) {
+    queue = queues[RandomQueue()].get();
+    lock = std::unique_lock<std::mutex>(queue->mutex);
+  }
+
+  queue->heap.Push(std::move(item));
+  // Counted while locked, so that a non-zero size always has an item
+  size++;
+}
+
+// Remove the better top of two random sub-heaps
+template <typename T, typename C, size_t D>
+bool ConcurrentPQueue<T, C, D>::TryPop(T &item) {
+  while (size.load()) {
+    size_t i = RandomQueue();
+    size_t j = RandomQueue();
+
+    // Pick other sub-heaps rather than waiting for a lock
+    std::unique_lock<std::mutex> lock_i(queues[i]->mutex, std::try_to_lock);
+    if (!lock_i)
+      continue;
+    std::unique_lock<std::mutex> lock_j;
+    if (j != i) {
+      lock_j = std::unique_lock<std::mutex>(queues[j]->mutex,
+                                            std::try_to_lock);
+      if (!lock_j)
+        continue;
+    }
+
+    PQueue<T, C, D> *best = nullptr;
+    if (queues[i]->heap.Size())
+      best = &queues[i]->heap;
+    if (queues[j]->heap.Size() &&
+        (!best || cmp(queues[j]->heap.Top(), best->Top())))
+      best = &queues[j]->heap;
+    if (!best)
+      continue;
+
+    item = best->PopTop();
+    size--;
+    return true;
+  }
+
+  return false;
 }
 
-// Node comparison
-template <typename T, typename C>
-bool PQueue<T, C>::CompareNodes(size_t i, size_t j) {
-     return cmp(items[i], items[j]);
+// Each thread draws its sub-heaps from its own generator
+template <typename T, typename C, size_t D>
+size_t ConcurrentPQueue<T, C, D>::RandomQueue() {
+  static thread_local std::minstd_rand gen(
+      std::hash<std::thread::id>()(std::this_thread::get_id()));
+  return gen() % queues.size();
 }
 
 
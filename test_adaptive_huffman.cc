@@ -0,0 +1,118 @@
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "adaptive_huffman.h"
+
+// Code the symbols and the end symbol, and return the bytes written
+std::string EncodeSymbols(const std::vector<int> &symbols) {
+  std::ostringstream oss(std::ios::out | std::ios::binary);
+  {
+    BinaryOutputStream bos(oss);
+    AdaptiveHuffmanTree tree;
+    for (int symbol : symbols)
+      tree.Encode(symbol, bos);
+    tree.Encode(AdaptiveHuffmanTree::kEndSymbol, bos);
+  }
+  return oss.str();
+}
+
+// Decode symbols up to the end symbol
+std::vector<int> DecodeSymbols(const std::string &coded) {
+  BinaryInputStream bis(coded.data(), coded.size());
+  AdaptiveHuffmanTree tree;
+  std::vector<int> symbols;
+  for (int symbol = tree.Decode(bis);
+       symbol != AdaptiveHuffmanTree::kEndSymbol; symbol = tree.Decode(bis))
+    symbols.push_back(symbol);
+  return symbols;
+}
+
+TEST(AdaptiveHuffman, empty) {
+  // Only the end symbol, new: the empty code of the root then 9 bits
+  std::string coded = EncodeSymbols({});
+  EXPECT_EQ(coded.size(), 2u);
+  EXPECT_EQ(DecodeSymbols(coded), std::vector<int>());
+}
+
+TEST(AdaptiveHuffman, single_symbol) {
+  // Once seen, a symbol alone takes one bit
+  std::vector<int> symbols(800, 'a');
+  std::string coded = EncodeSymbols(symbols);
+  EXPECT_LE(coded.size(), 2 + 800 / 8 + 4);
+  EXPECT_EQ(DecodeSymbols(coded), symbols);
+}
+
+TEST(AdaptiveHuffman, all_symbols) {
+  // Every byte value in turn, several times over
+  std::vector<int> symbols;
+  for (int i = 0; i < 256 * 4; i++)
+    symbols.push_back((i * 7) % 256);
+
+  EXPECT_EQ(DecodeSymbols(EncodeSymbols(symbols)), symbols);
+}
+
+TEST(AdaptiveHuffman, skewed) {
+  std::mt19937 gen(42);
+  std::geometric_distribution<int> dist(0.1);
+  std::vector<int> symbols(200000);
+  std::vector<size_t> counts(256, 0);
+  for (int &symbol : symbols) {
+    symbol = dist(gen) % 256;
+    counts[symbol]++;
+  }
+
+  std::string coded = EncodeSymbols(symbols);
+  EXPECT_EQ(DecodeSymbols(coded), symbols);
+
+  // The code follows the frequencies, within a bit per symbol of the
+  // entropy as a static Huffman code would be
+  double entropy_bits = 0;
+  for (size_t count : counts) {
+    if (count)
+      entropy_bits += count * std::log2(double(symbols.size()) / count);
+  }
+  EXPECT_LT(8.0 * coded.size(), entropy_bits + symbols.size());
+}
+
+TEST(AdaptiveHuffman, changing_frequencies) {
+  // The code adapts when the frequencies change along the input
+  std::vector<int> symbols;
+  for (int phase = 0; phase < 4; phase++) {
+    for (int i = 0; i < 20000; i++)
+      symbols.push_back(phase * 50 + (i % 7 == 0 ? i % 13 : 0));
+  }
+
+  EXPECT_EQ(DecodeSymbols(EncodeSymbols(symbols)), symbols);
+}
+
+TEST(AdaptiveHuffman, corrupted) {
+  // The NYT code followed by a symbol already seen: 9 bits of 'a' are new,
+  // then the NYT code (0) and 'a' again
+  std::ostringstream oss(std::ios::out | std::ios::binary);
+  {
+    BinaryOutputStream bos(oss);
+    bos.PutBits('a', 9);
+    bos.PutBit(0);
+    bos.PutBits('a', 9);
+  }
+  std::string coded = oss.str();
+
+  BinaryInputStream bis(coded.data(), coded.size());
+  AdaptiveHuffmanTree tree;
+  EXPECT_EQ(tree.Decode(bis), 'a');
+  EXPECT_THROW(tree.Decode(bis), std::runtime_error);
+
+  AdaptiveHuffmanTree encoder;
+  BinaryOutputStream bos(oss);
+  EXPECT_THROW(encoder.Encode(257, bos), std::out_of_range);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,5 +1,8 @@
 #include <cstdio>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -277,6 +280,344 @@ TEST(BStream, output_) {
   std::remove(filename.c_str());
 }
 
+TEST(BStream, put_bits) {
+  std::string filename{"test_bstream_output"};
+
+  // Write this to a file
+  std::ofstream ofs(filename, std::ios::out |
+                    std::ios::trunc |
+                    std::ios::binary);
+  BinaryOutputStream bos(ofs);
+  bos.PutBits(0x2, 2);  // 10
+  bos.PutBits(0x1, 1);  // 1
+  bos.PutBits(0x0, 3);  // 000
+  bos.PutBits(0xff2, 4);  // 0010 (only the low 4 bits are written)
+  bos.PutBits(0xdeadbeef, 32);
+  bos.PutBits(0x5, 3);  // 101
+  bos.Close();
+  ofs.close();
+  // Equivalent in binary is:
+  // 101000001011011110101011011011111011101111101000
+  // ^a  ^0  ^b  ^7  ^a  ^b  ^6  ^f  ^b  ^b  ^e  ^8  (padded with 0s)
+
+  // Read it back byte by byte
+  std::ifstream ifs(filename, std::ios::in |
+                    std::ios::binary);
+  std::vector<unsigned char> bytes;
+  char c;
+  while (ifs.get(c))
+    bytes.push_back(c);
+  ifs.close();
+
+  const std::vector<unsigned char> expected{
+    0xa0, 0xb7, 0xab, 0x6f, 0xbb, 0xe8
+  };
+  EXPECT_EQ(bytes, expected);
+
+  std::remove(filename.c_str());
+}
+
+TEST(BStream, peek_consume_bits) {
+  std::string filename{"test_bstream_input"};
+
+  const unsigned char val[] = {
+    0x58, 0x90, 0xab, 0x08,
+    0x00, 0x4e, 0xdb, 0x40,
+  };
+  // Equivalent in binary is:
+  // 0101100010010000101010110000100000000000010011101101101101000000
+  // ^5  ^8  ^9  ^0  ^a  ^b  ^0  ^8  ^0  ^0  ^4  ^e  ^d  ^b  ^4  ^0
+
+  // Write this to a file
+  std::ofstream ofs(filename, std::ios::out |
+                    std::ios::trunc |
+                    std::ios::binary);
+  ofs.write(reinterpret_cast<const char *>(val), sizeof(val));
+  ofs.close();
+
+  // Read it back in binary format
+  std::ifstream ifs(filename, std::ios::in |
+                    std::ios::binary);
+  BinaryInputStream bis(ifs);
+
+  // Peeking doesn't consume anything
+  EXPECT_EQ(bis.PeekBits(0), 0);
+  EXPECT_EQ(bis.PeekBits(3), 0x2);  // 010
+  EXPECT_EQ(bis.PeekBits(11), 0x2c4);  // 01011000100
+  bis.ConsumeBits(3);
+  EXPECT_EQ(bis.PeekBits(5), 0x18);  // 11000
+  EXPECT_EQ(bis.GetBit(), 1);
+  EXPECT_EQ(bis.GetBits(4), 0x8);  // 1000
+  EXPECT_EQ(bis.GetBits(32), 0x90ab0800);
+  EXPECT_EQ(bis.GetChar(), 0x4e);  // 01001110
+  bis.ConsumeBits(10);  // 1101101101
+
+  // Past the end of the input, peeked bits are padded with 0s
+  EXPECT_EQ(bis.PeekBits(12), 0x000);  // 000000 000000
+  EXPECT_EQ(bis.PeekBits(4), 0x0);
+  bis.ConsumeBits(6);
+  EXPECT_EQ(bis.PeekBits(8), 0x00);
+  EXPECT_THROW(bis.ConsumeBits(1), std::exception);
+  EXPECT_THROW(bis.GetBit(), std::exception);
+
+  ifs.close();
+
+  std::remove(filename.c_str());
+}
+
+TEST(BStream, peek_past_end) {
+  std::string filename{"test_bstream_input"};
+
+  const unsigned char val[] = { 0xff, 0x81 };
+
+  // Write this to a file
+  std::ofstream ofs(filename, std::ios::out |
+                    std::ios::trunc |
+                    std::ios::binary);
+  ofs.write(reinterpret_cast<const char *>(val), sizeof(val));
+  ofs.close();
+
+  // Read it back in binary format
+  std::ifstream ifs(filename, std::ios::in |
+                    std::ios::binary);
+  BinaryInputStream bis(ifs);
+
+  EXPECT_EQ(bis.PeekBits(20), 0xff810);  // 1111111110000001 0000
+  bis.ConsumeBits(12);
+  EXPECT_EQ(bis.PeekBits(8), 0x10);  // 0001 0000
+  EXPECT_EQ(bis.GetBits(4), 0x1);
+  EXPECT_THROW(bis.GetBits(1), std::exception);
+
+  ifs.close();
+
+  std::remove(filename.c_str());
+}
+
+TEST(BStream, align_to_byte) {
+  std::string filename{"test_bstream_output"};
+
+  // Write this to a file
+  std::ofstream ofs(filename, std::ios::out |
+                    std::ios::trunc |
+                    std::ios::binary);
+  BinaryOutputStream bos(ofs);
+  bos.PutBits(0x5, 3);  // 101
+  bos.AlignToByte();  // 10100000
+  bos.AlignToByte();  // Nothing to pad
+  bos.PutChar(0x7e);  // 01111110
+  bos.PutBit(1);
+  bos.AlignToByte();  // 10000000
+  ofs.close();
+
+  // Read it back in binary format
+  std::ifstream ifs(filename, std::ios::in |
+                    std::ios::binary);
+  BinaryInputStream bis(ifs);
+
+  EXPECT_EQ(bis.GetBit(), 1);
+  bis.AlignToByte();
+  bis.AlignToByte();
+  EXPECT_EQ(bis.GetChar(), 0x7e);
+  bis.AlignToByte();
+  EXPECT_EQ((unsigned char)bis.GetChar(), (unsigned char)0x80);
+  EXPECT_THROW(bis.GetBit(), std::exception);
+  ifs.close();
+
+  std::remove(filename.c_str());
+}
+
+TEST(BStream, input_memory) {
+  const unsigned char val[] = {
+    0x58, 0x90, 0xab, 0x08,
+    0x00, 0x4e, 0xdb, 0x40,
+  };
+  // Equivalent in binary is:
+  // 0101100010010000101010110000100000000000010011101101101101000000
+  // ^5  ^8  ^9  ^0  ^a  ^b  ^0  ^8  ^0  ^0  ^4  ^e  ^d  ^b  ^4  ^0
+
+  // Read it directly from memory
+  BinaryInputStream bis(reinterpret_cast<const char *>(val), sizeof(val));
+
+  // Make sure that we reading the binary in the correct order
+  EXPECT_EQ(bis.GetBit(), 0);
+  EXPECT_EQ(bis.GetBit(), 1);
+  EXPECT_EQ(bis.GetChar(), 0x62);  // 01100010
+  EXPECT_EQ(bis.GetChar(), 0x42);  // 01000010
+  EXPECT_EQ(bis.GetBit(), 1);
+  EXPECT_EQ(bis.GetInt(), 0x58400276);  // 01011000010000000000001001110110
+  EXPECT_EQ(bis.PeekBits(12), 0xda0);  // 11011010 0000
+  bis.ConsumeBits(5);
+  EXPECT_EQ(bis.GetBits(3), 0x2);  // 010
+  EXPECT_EQ(bis.GetBits(5), 0x0);  // 00000
+  EXPECT_THROW(bis.GetBit(), std::exception);
+}
+
+TEST(BStream, bytes) {
+  std::string filename{"test_bstream_output"};
+
+  // More bytes than one input block
+  std::string bytes;
+  for (size_t i = 0; i < 100000; i++)
+    bytes.push_back(static_cast<char>(i * 13));
+
+  std::ofstream ofs(filename, std::ios::out |
+                    std::ios::trunc |
+                    std::ios::binary);
+  {
+    BinaryOutputStream bos(ofs);
+    bos.PutChar(0x42);
+    bos.PutBytes(bytes.data(), bytes.size());
+    bos.PutBit(1);
+    bos.PutBytes(bytes.data(), 3);  // Out of the byte boundary
+  }
+  ofs.close();
+
+  std::ifstream ifs(filename, std::ios::in |
+                    std::ios::binary);
+  BinaryInputStream bis(ifs);
+  std::string read(bytes.size(), 0);
+
+  EXPECT_EQ(bis.GetBits(4), 0x4);
+  EXPECT_THROW(bis.GetBytes(&read[0], 1), std::logic_error);
+  EXPECT_EQ(bis.GetBits(4), 0x2);
+  bis.GetBytes(&read[0], read.size());
+  EXPECT_EQ(read, bytes);
+  EXPECT_EQ(bis.GetBit(), 1);
+  for (size_t i = 0; i < 3; i++)
+    EXPECT_EQ(bis.GetChar(), bytes[i]);
+  bis.AlignToByte();
+  EXPECT_THROW(bis.GetBytes(&read[0], 1), std::underflow_error);
+
+  ifs.close();
+
+  std::remove(filename.c_str());
+}
+
+TEST(BStream, round_trip_bits) {
+  std::string filename{"test_bstream_output"};
+
+  // Enough codes of every width to cross several input blocks
+  const size_t num_codes = 200000;
+  std::vector<uint32_t> values;
+  std::vector<size_t> widths;
+  uint32_t seed = 12345;
+  for (size_t i = 0; i < num_codes; i++) {
+    seed = seed * 1103515245 + 12345;
+    widths.push_back(1 + i % 32);
+    values.push_back(seed >> (32 - widths.back()));
+  }
+
+  // Write this to a file
+  std::ofstream ofs(filename, std::ios::out |
+                    std::ios::trunc |
+                    std::ios::binary);
+  {
+    BinaryOutputStream bos(ofs);
+    for (size_t i = 0; i < num_codes; i++) {
+      bos.PutBits(values[i], widths[i]);
+      if (i % 1000 == 0) {
+        bos.PutChar('Z');
+        bos.PutBit(1);
+        bos.PutInt(-2);
+      }
+    }
+  }
+  ofs.close();
+
+  // Read it back in binary format
+  std::ifstream ifs(filename, std::ios::in |
+                    std::ios::binary);
+  BinaryInputStream bis(ifs);
+
+  // Make sure that every code reads back the same, in any way it is read
+  for (size_t i = 0; i < num_codes; i++) {
+    if (i % 2)
+      ASSERT_EQ(bis.GetBits(widths[i]), values[i]);
+    else
+      ASSERT_EQ(bis.PeekBits(widths[i]), values[i]);
+    if (i % 2 == 0)
+      bis.ConsumeBits(widths[i]);
+    if (i % 1000 == 0) {
+      ASSERT_EQ(bis.GetChar(), 'Z');
+      ASSERT_EQ(bis.GetBit(), 1);
+      ASSERT_EQ(bis.GetInt(), -2);
+    }
+  }
+
+  ifs.close();
+
+  std::remove(filename.c_str());
+}
+
+TEST(BStream, output_string) {
+  std::string out{"zap"};
+  {
+    StringOutputBuffer buffer(out);
+    std::ostream os(&buffer);
+    BinaryOutputStream bos(os);
+    bos.PutBits(0x5, 3);
+    bos.PutInt(0x12345678);
+    bos.AlignToByte();
+    EXPECT_EQ(buffer.Size(), 3u + 5u);
+  }
+
+  // Written after the bytes already in the string
+  const unsigned char val[] = {
+    'z', 'a', 'p', 0xa2, 0x46, 0x8a, 0xcf, 0x00,
+  };
+  EXPECT_EQ(out, std::string(reinterpret_cast<const char *>(val),
+                             sizeof(val)));
+}
+
+TEST(BStream, output_string_reuse) {
+  std::string bytes;
+  for (size_t i = 0; i < 100000; i++)
+    bytes.push_back(static_cast<char>(i * 13));
+
+  std::string out;
+  for (size_t size : {100000, 1000, 0, 5000}) {
+    out.clear();
+    {
+      StringOutputBuffer buffer(out);
+      std::ostream os(&buffer);
+      BinaryOutputStream bos(os);
+      bos.PutBytes(bytes.data(), size / 2);
+      for (size_t i = size / 2; i < size; i++)
+        bos.PutChar(bytes[i]);
+    }
+    EXPECT_EQ(out, bytes.substr(0, size));
+  }
+
+  // The string kept its capacity from the largest output
+  EXPECT_GE(out.capacity(), bytes.size());
+}
+
+TEST(BStream, output_range) {
+  std::string bytes;
+  for (size_t i = 0; i < 10000; i++)
+    bytes.push_back(static_cast<char>(i * 7));
+
+  const struct {
+    uint64_t offset, length;
+  } ranges[] = {
+    {0, 0}, {0, 10000}, {0, 20000}, {3, 5}, {4095, 2}, {9999, 10},
+    {10000, 1},
+  };
+  for (const auto &range : ranges) {
+    std::ostringstream oss(std::ios::out | std::ios::binary);
+    {
+      RangeOutputBuffer buffer(oss, range.offset, range.length);
+      std::ostream os(&buffer);
+      BinaryOutputStream bos(os);
+      bos.PutBytes(bytes.data(), bytes.size() / 2);
+      for (size_t i = bytes.size() / 2; i < bytes.size(); i++)
+        bos.PutChar(bytes[i]);
+    }
+    std::string expected = range.offset < bytes.size()
+        ? bytes.substr(range.offset, range.length) : "";
+    EXPECT_EQ(oss.str(), expected) << range.offset << ":" << range.length;
+  }
+}
 
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
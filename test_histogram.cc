@@ -0,0 +1,80 @@
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "histogram.h"
+
+// Count the bytes one by one, to check CountBytes against
+std::vector<size_t> CountBytesSimple(const char *data, size_t size) {
+  std::vector<size_t> counts(256, 0);
+  for (size_t i = 0; i < size; i++)
+    counts[static_cast<unsigned char>(data[i])]++;
+  return counts;
+}
+
+TEST(Histogram, empty) {
+  std::vector<size_t> counts(256, 0);
+
+  CountBytes(nullptr, 0, counts.data());
+  EXPECT_EQ(counts, std::vector<size_t>(256, 0));
+}
+
+TEST(Histogram, all_bytes) {
+  // Every byte value, those above 0x7f included, several times over
+  std::vector<char> data;
+  for (size_t i = 0; i < 4096; i++)
+    data.push_back(static_cast<char>(i * 7));
+
+  std::vector<size_t> counts(256, 0);
+  CountBytes(data.data(), data.size(), counts.data());
+  EXPECT_EQ(counts, std::vector<size_t>(256, 16));
+}
+
+TEST(Histogram, single_byte) {
+  // Long runs of the same byte all go through the sub-histograms
+  std::vector<char> data(100003, static_cast<char>(0xff));
+
+  std::vector<size_t> counts(256, 0);
+  CountBytes(data.data(), data.size(), counts.data());
+  EXPECT_EQ(counts[0xff], data.size());
+  EXPECT_EQ(counts[0], 0);
+}
+
+TEST(Histogram, random) {
+  std::mt19937 gen(7);
+  std::uniform_int_distribution<int> dist(0, 255);
+  std::vector<char> data(70000);
+  for (char &c : data)
+    c = static_cast<char>(dist(gen));
+
+  // Sizes around the direct counting threshold and unaligned starts
+  const size_t sizes[] = {1, 15, 1023, 1024, 1025, 4099, 69000};
+  for (size_t size : sizes) {
+    for (size_t start = 0; start < 9; start++) {
+      std::vector<size_t> counts(256, 0);
+      CountBytes(data.data() + start, size, counts.data());
+      ASSERT_EQ(counts, CountBytesSimple(data.data() + start, size));
+    }
+  }
+}
+
+TEST(Histogram, accumulate) {
+  std::string data{"abracadabra"};
+
+  // Counts add up over several calls
+  std::vector<size_t> counts(256, 0);
+  CountBytes(data.data(), data.size(), counts.data());
+  CountBytes(data.data(), data.size(), counts.data());
+  EXPECT_EQ(counts['a'], 10);
+  EXPECT_EQ(counts['b'], 4);
+  EXPECT_EQ(counts['c'], 2);
+  EXPECT_EQ(counts['z'], 0);
+}
+
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,822 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "huffman.h"
+
+// Number of calls to operator new, to check code that must not allocate
+std::atomic<size_t> num_allocations(0);
+
+void *operator new(size_t size) {
+  num_allocations++;
+  void *p = std::malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  num_allocations++;
+  return std::malloc(size ? size : 1);
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  std::free(p);
+}
+
+// Access to the block types and the steps of Huffman
+class HuffmanTest {
+ public:
+  static const uint8_t kBlockHuffman = Huffman::kBlockHuffman;
+  static const uint8_t kBlockHuffmanInterleaved =
+      Huffman::kBlockHuffmanInterleaved;
+  static const uint8_t kBlockShared = Huffman::kBlockShared;
+  static const uint8_t kBlockSharedInterleaved =
+      Huffman::kBlockSharedInterleaved;
+  static const uint8_t kBlockAdaptive = Huffman::kBlockAdaptive;
+  static const uint8_t kBlockContext = Huffman::kBlockContext;
+  static const uint8_t kBlockStored = Huffman::kBlockStored;
+  static const uint8_t kBlockEnd = Huffman::kBlockEnd;
+  static const size_t kHeaderSize = Huffman::kHeaderSize;
+  static const uint8_t kFormatVersion = Huffman::kFormatVersion;
+
+  // Return the type of every block of the zap file, from its index. Files
+  // without index have at most one block, right after the header.
+  static std::vector<uint8_t> BlockTypes(const std::string &zap) {
+    std::vector<Huffman::BlockIndexEntry> index;
+    if (!Huffman::ReadIndex(zap.data(), zap.size(), index)) {
+      uint8_t type = zap.at(Huffman::kHeaderSize);
+      if (type == Huffman::kBlockEnd)
+        return std::vector<uint8_t>();
+      return std::vector<uint8_t>(1, type);
+    }
+
+    std::vector<uint8_t> types;
+    for (size_t i = 0; i + 1 < index.size(); i++)
+      types.push_back(zap[index[i].offset]);
+    return types;
+  }
+
+  static std::vector<uint8_t> LimitCodeLengths(std::vector<size_t> &freq,
+                                               size_t max_length) {
+    std::vector<uint8_t> lengths;
+    Huffman::PackageMergeLists package_merge;
+    Huffman::LimitCodeLengths(freq, max_length, lengths, package_merge);
+    return lengths;
+  }
+
+  // Return the code lengths written at the start of the first block
+  static std::vector<uint8_t> BlockLengths(const std::string &zap) {
+    BinaryInputStream input(zap.data() + kHeaderSize,
+                            zap.size() - kHeaderSize);
+    if (input.GetChar() != Huffman::kBlockHuffman)
+      return std::vector<uint8_t>();
+
+    std::vector<uint8_t> lengths;
+    Huffman::ReadLengths(input, lengths);
+    return lengths;
+  }
+
+  static std::vector<uint8_t> CodeLengths(std::vector<size_t> &freq) {
+    HuffmanTree tree;
+    std::vector<uint8_t> lengths;
+    Huffman::BuildTree(freq, tree);
+    Huffman::CodeLengths(tree, lengths);
+    return lengths;
+  }
+
+  // Time a sleep of ms milliseconds as the encode phase, then the total
+  static void TimeSleep(Huffman::Stats *stats, int ms) {
+    Huffman::PhaseTimer total(stats);
+    Huffman::PhaseTimer timer(stats);
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    timer.Lap(&Huffman::Stats::encode_seconds);
+    total.Finish();
+  }
+
+  // Write data as version 1 did: a single block without type or index
+  static std::string WriteVersion1(const std::string &data) {
+    std::ostringstream oss(std::ios::out | std::ios::binary);
+    {
+      BinaryOutputStream output(oss);
+      output.PutBits(Huffman::kMagic, 24);
+      output.PutChar(1);
+
+      std::vector<size_t> freq;
+      Huffman::CountInputFreq(data.data(), data.size(), freq);
+      std::vector<uint8_t> lengths = CodeLengths(freq);
+      std::vector<Huffman::HuffmanCode> code_table;
+      Huffman::BuildTable(lengths, code_table);
+
+      Huffman::OutputLengths(lengths, output);
+      Huffman::OutputNumChar(freq, output);
+      Huffman::OutputChar(code_table, output, data.data(), data.size());
+    }
+    return oss.str();
+  }
+};
+
+const uint8_t HuffmanTest::kBlockHuffman;
+const uint8_t HuffmanTest::kBlockHuffmanInterleaved;
+const uint8_t HuffmanTest::kBlockShared;
+const uint8_t HuffmanTest::kBlockSharedInterleaved;
+const uint8_t HuffmanTest::kBlockAdaptive;
+const uint8_t HuffmanTest::kBlockContext;
+const uint8_t HuffmanTest::kBlockStored;
+const uint8_t HuffmanTest::kBlockEnd;
+const size_t HuffmanTest::kHeaderSize;
+const uint8_t HuffmanTest::kFormatVersion;
+
+// Fibonacci counts of the first characters make the deepest trees
+std::vector<size_t> FibonacciFreq(size_t num_symbols, size_t step) {
+  std::vector<size_t> freq(256, 0);
+  size_t a = 1, b = 1;
+  for (size_t i = 0; i < num_symbols; i++) {
+    freq[i * step] = a;
+    std::swap(a, b);
+    b += a;
+  }
+  return freq;
+}
+
+// Text of a few words, where the previous character tells much about the
+// next one
+std::string GenerateText(size_t size, unsigned seed = 1) {
+  const char *words[] = {
+    "the ", "zap ", "block ", "code ", "length ", "table ", "{\"id\": ",
+    "\"level\": \"info\", ", "stream ", "huffman\n",
+  };
+  std::mt19937 gen(seed);
+  std::string text;
+  while (text.size() < size)
+    text += words[gen() % (sizeof(words) / sizeof(words[0]))];
+  text.resize(size);
+  return text;
+}
+
+std::string GenerateRandom(size_t size, unsigned seed = 1) {
+  std::mt19937 gen(seed);
+  std::string data(size, 0);
+  for (char &c : data)
+    c = static_cast<char>(gen());
+  return data;
+}
+
+// Read a JSON object of numbers and objects, as PrintStatsJson writes it,
+// into values named by their path such as "blocks.stored"
+bool ParseJson(std::istream &is, const std::string &prefix,
+               std::map<std::string, double> &values) {
+  char c;
+  if (!(is >> c) || c != '{')
+    return false;
+  if (is >> c && c == '}')
+    return true;
+  is.unget();
+
+  for (;;) {
+    std::string key;
+    if (!(is >> c) || c != '"' || !std::getline(is, key, '"'))
+      return false;
+    if (!(is >> c) || c != ':')
+      return false;
+
+    is >> std::ws;
+    if (is.peek() == '{') {
+      if (!ParseJson(is, prefix + key + ".", values))
+        return false;
+    } else if (!(is >> values[prefix + key])) {
+      return false;
+    }
+
+    if (!(is >> c))
+      return false;
+    if (c == '}')
+      return true;
+    if (c != ',')
+      return false;
+  }
+}
+
+std::string Compress(const std::string &data,
+                     const Huffman::CompressOptions &options) {
+  std::string zap;
+  Huffman::Compress(data.data(), data.size(), zap, options);
+  return zap;
+}
+
+std::string Decompress(const std::string &zap,
+                       const Huffman::DecompressOptions &options) {
+  std::string data;
+  Huffman::Decompress(zap.data(), zap.size(), data, options);
+  return data;
+}
+
+std::string DecompressRange(const std::string &zap, uint64_t offset,
+                            uint64_t length, size_t threads) {
+  Huffman::DecompressOptions options;
+  options.threads = threads;
+  std::ostringstream oss(std::ios::out | std::ios::binary);
+  Huffman::DecompressRange(zap.data(), zap.size(), oss, offset, length,
+                           options);
+  return oss.str();
+}
+
+// Check that the zap file decodes back to data with every decoder and
+// number of threads
+void ExpectRoundTrip(const std::string &data, const std::string &zap,
+                     const Huffman::SharedTable *table = nullptr) {
+  for (Huffman::DecodeMethod method : {Huffman::DecodeMethod::kTable,
+                                       Huffman::DecodeMethod::kBitwise}) {
+    for (size_t threads : {1, 3}) {
+      Huffman::DecompressOptions options;
+      options.method = method;
+      options.threads = threads;
+      options.table = table;
+      EXPECT_EQ(Decompress(zap, options), data) << threads << " threads";
+    }
+  }
+}
+
+// Check that the zap file holds a block of the type, and decodes back to
+// data with every decoder and number of threads
+void ExpectRoundTrip(const std::string &data, const std::string &zap,
+                     uint8_t type,
+                     const Huffman::SharedTable *table = nullptr) {
+  std::vector<uint8_t> types = HuffmanTest::BlockTypes(zap);
+  EXPECT_NE(std::find(types.begin(), types.end(), type), types.end())
+      << "No block of type " << int(type);
+  ExpectRoundTrip(data, zap, table);
+}
+
+TEST(Huffman, empty) {
+  std::string zap = Compress("", Huffman::CompressOptions());
+  EXPECT_EQ(zap.substr(0, 3), "ZAP");
+  EXPECT_TRUE(HuffmanTest::BlockTypes(zap).empty());
+  EXPECT_EQ(Decompress(zap, Huffman::DecompressOptions()), "");
+}
+
+TEST(Huffman, round_trip) {
+  std::string data = GenerateText(100000);
+  ExpectRoundTrip(data, Compress(data, Huffman::CompressOptions()));
+
+  // A single character, and a single character value
+  ExpectRoundTrip("a", Compress("a", Huffman::CompressOptions()));
+  std::string run(5000, 'a');
+  ExpectRoundTrip(run, Compress(run, Huffman::CompressOptions()));
+}
+
+TEST(Huffman, block_huffman) {
+  std::string data = GenerateText(100000);
+  Huffman::CompressOptions options;
+  options.block_size = 30000;
+  std::string zap = Compress(data, options);
+  EXPECT_EQ(HuffmanTest::BlockTypes(zap),
+            std::vector<uint8_t>(4, HuffmanTest::kBlockHuffman));
+  ExpectRoundTrip(data, zap);
+
+  // A single character value, over several blocks
+  std::string run(5000, 'a');
+  options.block_size = 3000;
+  ExpectRoundTrip(run, Compress(run, options), HuffmanTest::kBlockHuffman);
+}
+
+TEST(Huffman, block_interleaved) {
+  std::string data = GenerateText(100003);
+  Huffman::CompressOptions options;
+  options.block_size = 30000;
+  options.interleaved = true;
+  ExpectRoundTrip(data, Compress(data, options),
+                  HuffmanTest::kBlockHuffmanInterleaved);
+}
+
+TEST(Huffman, block_shared) {
+  std::string samples = GenerateText(100000, 2);
+  Huffman::SharedTable table = Huffman::TrainTable(
+      samples.data(), samples.size(), Huffman::kMaxCodeLength);
+
+  std::string data = GenerateText(2000);
+  Huffman::CompressOptions options;
+  options.block_size = 200;
+  options.table = &table;
+  ExpectRoundTrip(data, Compress(data, options), HuffmanTest::kBlockShared,
+                  &table);
+
+  options.interleaved = true;
+  ExpectRoundTrip(data, Compress(data, options),
+                  HuffmanTest::kBlockSharedInterleaved, &table);
+
+  // A table with codes over the limit isn't used, the blocks have their own
+  // code within it
+  uint8_t table_max_length =
+      *std::max_element(table.lengths.begin(), table.lengths.end());
+  ASSERT_GT(table_max_length, Huffman::kMinCodeLengthLimit);
+  options.interleaved = false;
+  options.max_code_length = table_max_length - 1;
+  std::string zap = Compress(data, options);
+  EXPECT_EQ(HuffmanTest::BlockTypes(zap),
+            std::vector<uint8_t>(10, HuffmanTest::kBlockHuffman));
+  ExpectRoundTrip(data, zap, &table);
+  options.block_size = data.size();
+  std::vector<uint8_t> lengths =
+      HuffmanTest::BlockLengths(Compress(data, options));
+  ASSERT_EQ(lengths.size(), 256u);
+  EXPECT_LE(*std::max_element(lengths.begin(), lengths.end()),
+            options.max_code_length);
+}
+
+TEST(Huffman, table_file) {
+  std::string samples = GenerateText(50000, 2);
+  Huffman::SharedTable table = Huffman::TrainTable(
+      samples.data(), samples.size(), Huffman::kMaxCodeLength);
+  std::ostringstream oss(std::ios::out | std::ios::binary);
+  Huffman::WriteTable(table, oss);
+  std::string file = oss.str();
+
+  Huffman::SharedTable read = Huffman::ReadTable(file.data(), file.size());
+  EXPECT_EQ(read.id, table.id);
+  EXPECT_EQ(read.lengths, table.lengths);
+
+  // Cut short anywhere
+  for (size_t size = 0; size < file.size(); size++)
+    EXPECT_THROW(Huffman::ReadTable(file.data(), size), std::runtime_error)
+        << size << " bytes";
+
+  // Another magic, version, id, or lengths than the id was made from
+  for (size_t pos : {0, 3, 4, 8, 20}) {
+    std::string corrupt = file;
+    corrupt[pos] ^= 0x10;
+    EXPECT_THROW(Huffman::ReadTable(corrupt.data(), corrupt.size()),
+                 std::runtime_error)
+        << "byte " << pos;
+  }
+
+  // Blocks coded with a table can't be decoded with another, nor without
+  std::string data = GenerateText(2000);
+  Huffman::CompressOptions options;
+  options.block_size = 200;
+  options.table = &table;
+  std::string zap = Compress(data, options);
+
+  std::string other_samples = GenerateRandom(50000);
+  Huffman::SharedTable other = Huffman::TrainTable(
+      other_samples.data(), other_samples.size(), Huffman::kMaxCodeLength);
+  ASSERT_NE(other.id, table.id);
+  Huffman::DecompressOptions decompress_options;
+  decompress_options.table = &other;
+  EXPECT_THROW(Decompress(zap, decompress_options), std::runtime_error);
+  decompress_options.table = nullptr;
+  EXPECT_THROW(Decompress(zap, decompress_options), std::runtime_error);
+  decompress_options.table = &read;
+  EXPECT_EQ(Decompress(zap, decompress_options), data);
+}
+
+TEST(Huffman, single_block_index) {
+  // A file of a single block has no index, and is still decoded with
+  // threads or by range
+  std::string data = GenerateText(5000);
+  std::string zap = Compress(data, Huffman::CompressOptions());
+  EXPECT_EQ(static_cast<uint8_t>(zap.back()), HuffmanTest::kBlockEnd);
+  ExpectRoundTrip(data, zap, HuffmanTest::kBlockHuffman);
+  EXPECT_EQ(DecompressRange(zap, 100, 50, 4), data.substr(100, 50));
+
+  // Two blocks have one
+  Huffman::CompressOptions options;
+  options.block_size = 2500;
+  zap = Compress(data, options);
+  EXPECT_EQ(zap.substr(zap.size() - 4), "ZIDX");
+  EXPECT_EQ(HuffmanTest::BlockTypes(zap).size(), 2u);
+}
+
+TEST(Huffman, block_context) {
+  std::string data = GenerateText(200000);
+  Huffman::CompressOptions options;
+  options.block_size = 70000;
+  std::string plain = Compress(data, options);
+
+  for (size_t groups : {2, 16, 256}) {
+    options.context_groups = groups;
+    std::string zap = Compress(data, options);
+    ExpectRoundTrip(data, zap, HuffmanTest::kBlockContext);
+    EXPECT_LT(zap.size(), plain.size()) << groups << " groups";
+  }
+}
+
+TEST(Huffman, block_context_below_entropy) {
+  // Every byte value in turn: 8 bits of entropy per character, but each
+  // one follows from the one before. Such blocks must not be stored.
+  std::string data(1 << 20, 0);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<char>(i);
+
+  Huffman::CompressOptions options;
+  options.context_groups = 256;
+  std::string zap = Compress(data, options);
+  ExpectRoundTrip(data, zap, HuffmanTest::kBlockContext);
+  EXPECT_LT(zap.size(), data.size() / 4);
+}
+
+TEST(Huffman, block_stored) {
+  std::string data = GenerateRandom(100000);
+  Huffman::CompressOptions options;
+  options.block_size = 30000;
+  std::string zap = Compress(data, options);
+  ExpectRoundTrip(data, zap, HuffmanTest::kBlockStored);
+
+  // Stored blocks cost their type and size, and the index
+  EXPECT_LT(zap.size(), data.size() + 100);
+
+  // A single character takes more with a code than as it is
+  ExpectRoundTrip("a", Compress("a", options), HuffmanTest::kBlockStored);
+
+  // Nor do tables chosen by the previous character help
+  options.context_groups = 16;
+  EXPECT_EQ(HuffmanTest::BlockTypes(Compress(data, options)),
+            std::vector<uint8_t>(4, HuffmanTest::kBlockStored));
+}
+
+TEST(Huffman, block_adaptive) {
+  std::string data = GenerateText(100000);
+  std::istringstream iss(data, std::ios::in | std::ios::binary);
+  std::ostringstream oss(std::ios::out | std::ios::binary);
+  Huffman::CompressAdaptive(iss, oss);
+  ExpectRoundTrip(data, oss.str(), HuffmanTest::kBlockAdaptive);
+
+  // The streaming decoder gives the same characters
+  std::istringstream zap(oss.str(), std::ios::in | std::ios::binary);
+  AdaptiveHuffmanDecoder decoder(zap);
+  std::string decoded(data.size() + 1, 0);
+  EXPECT_EQ(decoder.Read(&decoded[0], decoded.size()), data.size());
+  decoded.resize(data.size());
+  EXPECT_EQ(decoded, data);
+
+  // Without index, ranges are cut from the decoded stream
+  EXPECT_EQ(DecompressRange(oss.str(), 5000, 300, 2), data.substr(5000, 300));
+}
+
+TEST(Huffman, block_adaptive_file_threads) {
+  // Adaptive files have no blocks in the index, so decoding them with
+  // threads goes back to the stream after looking for it in the file
+  std::string data = GenerateText(1 << 20);
+  std::string filename{"test_huffman_adaptive.zap"};
+  {
+    std::istringstream iss(data, std::ios::in | std::ios::binary);
+    std::ofstream ofs(filename, std::ios::out | std::ios::trunc |
+                      std::ios::binary);
+    Huffman::CompressAdaptive(iss, ofs);
+  }
+
+  std::string output_filename{"test_huffman_adaptive.out"};
+  for (size_t threads : {1, 4}) {
+    Huffman::DecompressOptions options;
+    options.threads = threads;
+    {
+      std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+      std::ofstream ofs(output_filename, std::ios::out | std::ios::trunc |
+                        std::ios::binary);
+      Huffman::Decompress(ifs, ofs, options);
+    }
+    std::ifstream decoded(output_filename, std::ios::in | std::ios::binary);
+    std::ostringstream contents(std::ios::out | std::ios::binary);
+    contents << decoded.rdbuf();
+    EXPECT_EQ(contents.str(), data) << threads << " threads";
+  }
+
+  std::remove(filename.c_str());
+  std::remove(output_filename.c_str());
+}
+
+TEST(Huffman, thread_invariance) {
+  // Mixed data, so that blocks of several types are coded at once
+  std::string data = GenerateText(150000) + GenerateRandom(50000) +
+                     GenerateText(100000, 3);
+  for (size_t context_groups : {1, 16}) {
+    Huffman::CompressOptions options;
+    options.block_size = 16384;
+    options.context_groups = context_groups;
+    std::string zap = Compress(data, options);
+
+    for (size_t threads : {2, 3, 8}) {
+      options.threads = threads;
+      EXPECT_EQ(Compress(data, options), zap) << threads << " threads";
+
+      Huffman::DecompressOptions decompress_options;
+      decompress_options.threads = threads;
+      EXPECT_EQ(Decompress(zap, decompress_options), data)
+          << threads << " threads";
+    }
+  }
+}
+
+TEST(Huffman, decompress_range) {
+  std::string data = GenerateText(10000);
+  Huffman::CompressOptions options;
+  options.block_size = 1000;
+  std::string zap = Compress(data, options);
+  // Files without an index are decoded from the start
+  std::string version_1 = HuffmanTest::WriteVersion1(data);
+
+  const struct {
+    uint64_t offset, length;
+  } ranges[] = {
+    {0, 0}, {500, 0}, {0, 10000}, {0, 20000},
+    // Within a block, and across one or several block boundaries
+    {10, 20}, {999, 2}, {1000, 1000}, {500, 3000},
+    // At the end, and past it
+    {9999, 1}, {9990, 100}, {10000, 5}, {20000, 5},
+  };
+  for (const auto &range : ranges) {
+    std::string expected =
+        range.offset < data.size() ? data.substr(range.offset, range.length)
+                                   : "";
+    for (size_t threads : {1, 4}) {
+      EXPECT_EQ(DecompressRange(zap, range.offset, range.length, threads),
+                expected)
+          << range.offset << ":" << range.length << ", " << threads
+          << " threads";
+      EXPECT_EQ(DecompressRange(version_1, range.offset, range.length,
+                                threads),
+                expected)
+          << range.offset << ":" << range.length << ", version 1";
+    }
+  }
+}
+
+TEST(Huffman, stats) {
+  // Two blocks of text, and one of random bytes which is stored
+  std::string data = GenerateText(60000) + GenerateRandom(30000);
+  Huffman::CompressOptions options;
+  options.block_size = 30000;
+  Huffman::Stats compress_stats;
+  options.stats = &compress_stats;
+  std::string zap = Compress(data, options);
+
+  Huffman::DecompressOptions decompress_options;
+  Huffman::Stats decompress_stats;
+  decompress_options.stats = &decompress_stats;
+  EXPECT_EQ(Decompress(zap, decompress_options), data);
+
+  for (const Huffman::Stats *stats : {&compress_stats, &decompress_stats}) {
+    for (size_t type = 0; type < Huffman::kNumBlockTypes; type++) {
+      EXPECT_EQ(stats->blocks[type],
+                type == HuffmanTest::kBlockHuffman ? 2u :
+                type == HuffmanTest::kBlockStored ? 1u : 0u)
+          << Huffman::BlockTypeName(type);
+    }
+    EXPECT_EQ(stats->symbols, data.size());
+    EXPECT_GT(stats->total_seconds, 0);
+    EXPECT_GT(stats->peak_memory, 0u);
+  }
+  EXPECT_EQ(compress_stats.bytes_in, data.size());
+  EXPECT_EQ(compress_stats.bytes_out, zap.size());
+  EXPECT_EQ(decompress_stats.bytes_in, zap.size());
+  EXPECT_EQ(decompress_stats.bytes_out, data.size());
+
+  // The stored block costs 8 bits per character, above its entropy
+  EXPECT_GT(compress_stats.coded_bits, compress_stats.entropy_bits);
+  EXPECT_GE(compress_stats.coded_bits, 8u * 30000);
+
+  std::ostringstream text;
+  Huffman::PrintStats(compress_stats, text);
+  EXPECT_NE(text.str().find("bytes in: 90000\n"), std::string::npos);
+  EXPECT_NE(text.str().find("huffman blocks: 2\n"), std::string::npos);
+  EXPECT_NE(text.str().find("stored blocks: 1\n"), std::string::npos);
+  EXPECT_EQ(text.str().find("context blocks"), std::string::npos);
+
+  std::stringstream json;
+  Huffman::PrintStatsJson(compress_stats, json);
+  std::map<std::string, double> values;
+  ASSERT_TRUE(ParseJson(json, "", values)) << json.str();
+  json >> std::ws;
+  EXPECT_TRUE(json.eof()) << json.str();
+
+  EXPECT_EQ(values["bytes_in"], data.size());
+  EXPECT_EQ(values["bytes_out"], zap.size());
+  EXPECT_EQ(values["symbols"], data.size());
+  EXPECT_DOUBLE_EQ(values["total_seconds"], compress_stats.total_seconds);
+  for (size_t type = 0; type < Huffman::kNumBlockTypes; type++) {
+    std::string name = std::string("blocks.") + Huffman::BlockTypeName(type);
+    ASSERT_EQ(values.count(name), 1u) << name;
+    EXPECT_EQ(values[name], compress_stats.blocks[type]) << name;
+  }
+}
+
+TEST(Huffman, phase_timer) {
+  Huffman::Stats stats;
+  HuffmanTest::TimeSleep(&stats, 20);
+  EXPECT_GE(stats.encode_seconds, 0.02);
+  EXPECT_GE(stats.total_seconds, stats.encode_seconds);
+  EXPECT_EQ(stats.decode_seconds, 0);
+  EXPECT_GT(stats.peak_memory, 0u);
+
+  // Timers without stats measure nothing
+  HuffmanTest::TimeSleep(nullptr, 1);
+}
+
+TEST(Huffman, encoder_decoder) {
+  std::string samples = GenerateText(50000, 2);
+  Huffman::SharedTable table = Huffman::TrainTable(
+      samples.data(), samples.size(), Huffman::kMaxCodeLength);
+
+  // Text with a run of random bytes, so that some blocks are stored
+  std::string data = GenerateText(20000) + GenerateRandom(3000) +
+                     GenerateText(500, 3);
+
+  for (size_t block_size : {size_t(1000), Huffman::kDefaultBlockSize}) {
+    for (bool interleaved : {false, true}) {
+      for (size_t context_groups : {1, 16}) {
+        for (const Huffman::SharedTable *shared :
+             {static_cast<Huffman::SharedTable *>(nullptr), &table}) {
+          for (size_t max_code_length : {9, 32}) {
+            Huffman::CompressOptions options;
+            options.block_size = block_size;
+            options.interleaved = interleaved;
+            options.context_groups = context_groups;
+            options.table = shared;
+            options.max_code_length = max_code_length;
+            Huffman::DecompressOptions decompress_options;
+            decompress_options.table = shared;
+
+            std::string zap = Compress(data, options);
+            HuffmanEncoder encoder(options);
+            HuffmanDecoder decoder(decompress_options);
+            std::string coded, decoded;
+            encoder.Compress(data.data(), data.size(), coded);
+            decoder.Decompress(coded.data(), coded.size(), decoded);
+            EXPECT_EQ(coded, zap);
+            EXPECT_EQ(decoded, data);
+
+            // Once the tables and strings have grown, nothing is allocated
+            size_t before = num_allocations;
+            encoder.Compress(data.data(), data.size(), coded);
+            decoder.Decompress(coded.data(), coded.size(), decoded);
+            EXPECT_EQ(num_allocations - before, 0u)
+                << "block size " << block_size << ", interleaved "
+                << interleaved << ", " << context_groups << " groups, "
+                << (shared ? "shared table, " : "") << "limit "
+                << max_code_length;
+            EXPECT_EQ(coded, zap);
+            EXPECT_EQ(decoded, data);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(Huffman, legacy_unversioned) {
+  // Files from before the header: the preorder tree, 'a' = 0, 'b' = 10 and
+  // 'r' = 11, then the number of characters and their codes
+  std::ostringstream oss(std::ios::out | std::ios::binary);
+  {
+    BinaryOutputStream output(oss);
+    output.PutBit(0);
+    output.PutBit(1);
+    output.PutChar('a');
+    output.PutBit(0);
+    output.PutBit(1);
+    output.PutChar('b');
+    output.PutBit(1);
+    output.PutChar('r');
+    output.PutInt(4);
+    output.PutBits(0x16, 6);  // 0 10 11 0
+  }
+
+  for (Huffman::DecodeMethod method : {Huffman::DecodeMethod::kTable,
+                                       Huffman::DecodeMethod::kBitwise}) {
+    Huffman::DecompressOptions options;
+    options.method = method;
+    options.threads = 2;
+    EXPECT_EQ(Decompress(oss.str(), options), "abra");
+  }
+}
+
+TEST(Huffman, legacy_version_1) {
+  std::string data = GenerateText(5000);
+  std::string zap = HuffmanTest::WriteVersion1(data);
+
+  for (Huffman::DecodeMethod method : {Huffman::DecodeMethod::kTable,
+                                       Huffman::DecodeMethod::kBitwise}) {
+    Huffman::DecompressOptions options;
+    options.method = method;
+    options.threads = 2;
+    EXPECT_EQ(Decompress(zap, options), data);
+  }
+}
+
+TEST(Huffman, limit_code_lengths) {
+  std::vector<size_t> freq = FibonacciFreq(40, 3);
+  std::vector<uint8_t> unlimited = HuffmanTest::CodeLengths(freq);
+  EXPECT_GT(*std::max_element(unlimited.begin(), unlimited.end()), 32);
+
+  for (size_t max_length = Huffman::kMinCodeLengthLimit;
+       max_length <= Huffman::kMaxCodeLength; max_length++) {
+    std::vector<uint8_t> lengths =
+        HuffmanTest::LimitCodeLengths(freq, max_length);
+    ASSERT_EQ(lengths.size(), 256u);
+
+    // Every character has a code within the bound, and the codes fill the
+    // code space exactly (Kraft sum of 1)
+    uint64_t kraft = 0;
+    for (size_t i = 0; i < 256; i++) {
+      EXPECT_EQ(lengths[i] != 0, freq[i] != 0) << "character " << i;
+      EXPECT_LE(lengths[i], max_length);
+      if (lengths[i])
+        kraft += uint64_t(1) << (Huffman::kMaxCodeLength - lengths[i]);
+    }
+    EXPECT_EQ(kraft, uint64_t(1) << Huffman::kMaxCodeLength)
+        << "limit " << max_length;
+  }
+}
+
+TEST(Huffman, max_code_length) {
+  // Characters of Fibonacci counts, shuffled, with codes up to 24 bits
+  std::vector<size_t> freq = FibonacciFreq(25, 1);
+  std::string data;
+  for (size_t i = 0; i < freq.size(); i++)
+    data.append(freq[i], static_cast<char>(i));
+  std::shuffle(data.begin(), data.end(), std::mt19937(5));
+
+  std::vector<uint8_t> unlimited = HuffmanTest::CodeLengths(freq);
+  for (size_t max_length : {8, 10, 16}) {
+    EXPECT_GT(*std::max_element(unlimited.begin(), unlimited.end()),
+              max_length);
+
+    Huffman::CompressOptions options;
+    options.max_code_length = max_length;
+    std::string zap = Compress(data, options);
+    ExpectRoundTrip(data, zap);
+
+    std::vector<uint8_t> lengths = HuffmanTest::BlockLengths(zap);
+    ASSERT_EQ(lengths.size(), 256u);
+    EXPECT_LE(*std::max_element(lengths.begin(), lengths.end()), max_length);
+  }
+
+  Huffman::CompressOptions options;
+  for (size_t max_length : {size_t(0), Huffman::kMinCodeLengthLimit - 1,
+                            Huffman::kMaxCodeLength + 1}) {
+    options.max_code_length = max_length;
+    EXPECT_THROW(Compress(data, options), std::invalid_argument);
+  }
+}
+
+TEST(Huffman, corrupted) {
+  std::string data = GenerateText(20000);
+  Huffman::CompressOptions options;
+  options.block_size = 4096;
+  std::string zap = Compress(data, options);
+  Huffman::DecompressOptions decompress_options;
+
+  // Unknown block type
+  std::string bad_type = zap;
+  bad_type[HuffmanTest::kHeaderSize] = 0x7f;
+  EXPECT_THROW(Decompress(bad_type, decompress_options), std::runtime_error);
+
+  // Version from the future
+  std::string bad_version = zap;
+  bad_version[HuffmanTest::kHeaderSize - 1] =
+      HuffmanTest::kFormatVersion + 1;
+  EXPECT_THROW(Decompress(bad_version, decompress_options),
+               std::runtime_error);
+
+  // Cut short
+  EXPECT_ANY_THROW(Decompress(zap.substr(0, zap.size() / 2),
+                              decompress_options));
+
+  // Flipped bits are either rejected or decoded into some output, never
+  // read out of bounds
+  std::mt19937 gen(7);
+  for (size_t threads : {1, 2}) {
+    decompress_options.threads = threads;
+    for (int i = 0; i < 200; i++) {
+      std::string flipped = zap;
+      for (int j = 0; j < 3; j++)
+        flipped[gen() % flipped.size()] ^= 1 << (gen() % 8);
+      try {
+        Decompress(flipped, decompress_options);
+      } catch (const std::exception &) {
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,4 +1,11 @@
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
 #include <gtest/gtest.h>
 
 #include "pqueue.h"
@@ -298,6 +305,280 @@ TEST(PQueue, custom_class_pointer_max) {
   EXPECT_EQ(pq.Top(), vec[3]);
 }
 
+//  Test that many pushes and pops give the items in order
+TEST(PQueue, push_pop_many) {
+  std::mt19937 gen(3);
+  std::vector<int> vec(1000);
+  for (int &n : vec)
+    n = gen() % 100;
+
+  PQueue<int> pq;
+  for (int n : vec)
+    pq.Push(n);
+  EXPECT_EQ(pq.Size(), vec.size());
+
+  std::sort(vec.begin(), vec.end());
+  for (int n : vec) {
+    EXPECT_EQ(pq.Top(), n);
+    pq.Pop();
+  }
+  EXPECT_EQ(pq.Size(), 0);
+}
+
+//  Test building the heap from a range
+TEST(PQueue, range_constructor) {
+  std::vector<int> vec{5, 3, 9, 1, 7, 3, 8, 2, 6, 4};
+
+  PQueue<int> pq(vec.begin(), vec.end());
+  EXPECT_EQ(pq.Size(), vec.size());
+
+  std::sort(vec.begin(), vec.end());
+  for (int n : vec)
+    EXPECT_EQ(pq.PopTop(), n);
+  EXPECT_THROW(pq.PopTop(), std::exception);
+
+  // Empty range
+  PQueue<int, std::greater<int>> empty(vec.end(), vec.end());
+  EXPECT_EQ(empty.Size(), 0);
+}
+
+//  Test that Reserve keeps the items in place
+TEST(PQueue, reserve) {
+  PQueue<int> pq;
+
+  pq.Reserve(100);
+  pq.Push(3);
+  const int *top = &pq.Top();
+  for (int i = 0; i < 99; i++)
+    pq.Push(10 + i);
+  EXPECT_EQ(&pq.Top(), top);
+  EXPECT_EQ(pq.Top(), 3);
+}
+
+//  Test building items in place
+TEST(PQueue, emplace) {
+  PQueue<std::string> pq;
+
+  pq.Emplace(3, 'c');
+  pq.Emplace("bb");
+  pq.Emplace(4, 'a');
+
+  EXPECT_EQ(pq.Size(), 3);
+  EXPECT_EQ(pq.PopTop(), "aaaa");
+  EXPECT_EQ(pq.PopTop(), "bb");
+  EXPECT_EQ(pq.PopTop(), "ccc");
+}
+
+//  Test move-only items with the pointer comparators
+TEST(PQueue, move_only) {
+  typedef std::unique_ptr<MyClass> MyClassPtr;
+  PQueue<MyClassPtr, MyClassPtrCompMin<MyClassPtr>> pq;
+
+  pq.Push(MyClassPtr(new MyClass(42)));
+  pq.Push(MyClassPtr(new MyClass(23)));
+  MyClassPtr item(new MyClass(2));
+  pq.Push(std::move(item));
+  pq.Emplace(new MyClass(34));
+
+  EXPECT_EQ(pq.Size(), 4);
+  EXPECT_EQ(pq.Top()->n(), 2);
+  MyClassPtr top = pq.PopTop();
+  EXPECT_EQ(top->n(), 2);
+  EXPECT_EQ(pq.PopTop()->n(), 23);
+  EXPECT_EQ(pq.PopTop()->n(), 34);
+  EXPECT_EQ(pq.PopTop()->n(), 42);
+  EXPECT_EQ(pq.Size(), 0);
+}
+
+//  Test heaps of higher arity against sorting
+TEST(PQueue, arity) {
+  std::mt19937 gen(5);
+  std::vector<int> vec(1000);
+  for (int &n : vec)
+    n = gen() % 500;
+
+  PQueue<int, std::less<int>, 4> pq4;
+  PQueue<int, std::greater<int>, 8> pq8(vec.begin(), vec.begin() + 500);
+  PQueue<int, std::less<int>, 3> pq3(vec.begin(), vec.end());
+  for (int n : vec)
+    pq4.Push(n);
+  for (size_t i = 500; i < vec.size(); i++)
+    pq8.Emplace(vec[i]);
+
+  std::vector<int> sorted(vec);
+  std::sort(sorted.begin(), sorted.end());
+  for (size_t i = 0; i < sorted.size(); i++) {
+    ASSERT_EQ(pq4.PopTop(), sorted[i]);
+    ASSERT_EQ(pq3.PopTop(), sorted[i]);
+    ASSERT_EQ(pq8.PopTop(), sorted[sorted.size() - 1 - i]);
+  }
+  EXPECT_EQ(pq4.Size(), 0);
+  EXPECT_THROW(pq8.Top(), std::exception);
+}
+
+//  Test changing and removing queued items through their handles
+TEST(IndexedPQueue, update_erase) {
+  IndexedPQueue<int> pq;
+
+  auto a = pq.Push(30);
+  auto b = pq.Push(20);
+  auto c = pq.Push(10);
+  auto d = pq.Push(40);
+
+  EXPECT_EQ(pq.Top(), 10);
+  EXPECT_EQ(pq.TopHandle(), c);
+  EXPECT_EQ(pq.Get(a), 30);
+
+  // Decrease and increase priorities
+  pq.Update(d, 5);
+  EXPECT_EQ(pq.TopHandle(), d);
+  pq.Update(d, 50);
+  EXPECT_EQ(pq.TopHandle(), c);
+
+  pq.Erase(c);
+  EXPECT_FALSE(pq.Contains(c));
+  EXPECT_EQ(pq.Size(), 3);
+  EXPECT_THROW(pq.Erase(c), std::out_of_range);
+  EXPECT_THROW(pq.Update(c, 1), std::out_of_range);
+
+  EXPECT_EQ(pq.PopTop(), 20);
+  EXPECT_FALSE(pq.Contains(b));
+  EXPECT_EQ(pq.Top(), 30);
+  pq.Pop();
+  EXPECT_EQ(pq.PopTop(), 50);
+  EXPECT_THROW(pq.Top(), std::underflow_error);
+  EXPECT_THROW(pq.Pop(), std::underflow_error);
+}
+
+//  Test random updates and removals against a sort
+TEST(IndexedPQueue, random) {
+  typedef IndexedPQueue<int, std::greater<int>, 4> Queue;
+  std::mt19937 gen(11);
+  Queue pq;
+  std::vector<Queue::Handle> handles;
+
+  for (int i = 0; i < 2000; i++)
+    handles.push_back(pq.Push(gen() % 1000));
+
+  // Re-estimate every item, and drop one in four
+  std::vector<int> expected;
+  for (size_t i = 0; i < handles.size(); i++) {
+    if (i % 4 == 0) {
+      pq.Erase(handles[i]);
+    } else {
+      pq.Update(handles[i], gen() % 1000);
+      expected.push_back(pq.Get(handles[i]));
+    }
+  }
+
+  std::sort(expected.begin(), expected.end(), std::greater<int>());
+  ASSERT_EQ(pq.Size(), expected.size());
+  for (int priority : expected)
+    ASSERT_EQ(pq.PopTop(), priority);
+
+  // Handles are reused once their items are gone
+  auto handle = pq.Push(7);
+  EXPECT_LT(handle, handles.size());
+  EXPECT_EQ(pq.Get(handle), 7);
+}
+
+//  Test that a single sub-heap keeps the exact order
+TEST(ConcurrentPQueue, one_queue) {
+  ConcurrentPQueue<MyClass*, MyClassPtrCompMax<MyClass*>> pq(1);
+  std::vector<MyClass> vec{MyClass(42), MyClass(23), MyClass(2), MyClass(34)};
+
+  for (MyClass &item : vec)
+    pq.Push(&item);
+  EXPECT_EQ(pq.Size(), 4);
+
+  MyClass *item;
+  ASSERT_TRUE(pq.TryPop(item));
+  EXPECT_EQ(item->n(), 42);
+  ASSERT_TRUE(pq.TryPop(item));
+  EXPECT_EQ(item->n(), 34);
+  ASSERT_TRUE(pq.TryPop(item));
+  EXPECT_EQ(item->n(), 23);
+  ASSERT_TRUE(pq.TryPop(item));
+  EXPECT_EQ(item->n(), 2);
+  EXPECT_FALSE(pq.TryPop(item));
+}
+
+//  Test that every item pushed from several threads is popped exactly once
+TEST(ConcurrentPQueue, stress) {
+  const int num_threads = 4;
+  const int items_per_thread = 20000;
+  ConcurrentPQueue<int> pq(8);
+  std::vector<std::atomic<int>> popped(num_threads * items_per_thread);
+  std::atomic<int> num_popped(0);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    // Producers
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < items_per_thread; i++)
+        pq.Push(t * items_per_thread + i);
+    });
+    // Consumers, until all the items are gone
+    threads.emplace_back([&]() {
+      int item;
+      while (num_popped.load() < num_threads * items_per_thread) {
+        if (pq.TryPop(item)) {
+          popped[item]++;
+          num_popped++;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+
+  EXPECT_EQ(pq.Size(), 0);
+  for (auto &count : popped)
+    ASSERT_EQ(count.load(), 1);
+}
+
+//  Test that pushes waiting for a sub-heap held by others all land
+TEST(ConcurrentPQueue, contended_push) {
+  const int num_threads = 4;
+  const int items_per_thread = 20000;
+  ConcurrentPQueue<int> pq(1);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < items_per_thread; i++)
+        pq.Push(t * items_per_thread + i);
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+
+  // With one sub-heap, the items come out in order
+  EXPECT_EQ(pq.Size(), num_threads * items_per_thread);
+  int item;
+  for (int i = 0; i < num_threads * items_per_thread; i++) {
+    ASSERT_TRUE(pq.TryPop(item));
+    ASSERT_EQ(item, i);
+  }
+  EXPECT_FALSE(pq.TryPop(item));
+}
+
+//  Test that the popped items come roughly in order
+TEST(ConcurrentPQueue, relaxed_order) {
+  ConcurrentPQueue<int> pq(4);
+  for (int i = 0; i < 1000; i++)
+    pq.Push(999 - i);
+
+  // The first item is among the best of a sub-heap, and no item is lost
+  int item, sum = 0;
+  ASSERT_TRUE(pq.TryPop(item));
+  EXPECT_LT(item, 100);
+  sum += item;
+  while (pq.TryPop(item))
+    sum += item;
+  EXPECT_EQ(sum, 999 * 1000 / 2);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
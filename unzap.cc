@@ -1,28 +1,134 @@
+#include <cctype>
+#include <cstring>
+#include <string>
+
 #include "huffman.h"
+#include "mapped_file.h"
+
+// Read a decimal number, return false if arg isn't one
+bool ParseNumber(const std::string &arg, uint64_t &number) {
+  char *end;
+  number = std::strtoull(arg.c_str(), &end, 10);
+  return !arg.empty() && !*end && std::isdigit(arg[0]);
+}
 
 int main(int argc, char* argv[]) {
+    Huffman::DecompressOptions options;
+    std::vector<char*> files;
+    Huffman::Stats stats;
+    bool json_stats = false;
+    Huffman::SharedTable table;
+    bool use_range = false;
+    uint64_t range_offset = 0, range_length = 0;
+
+    // Split the options from the file names
+    for (int i = 1; i < argc; i++) {
+      if (!std::strcmp(argv[i], "-T")) {
+        if (i + 1 == argc) {
+          std::cerr << "Error: -T needs a number of threads." << std::endl;
+          exit(1);
+        }
+        uint64_t threads;
+        if (!ParseNumber(argv[++i], threads) || !threads) {
+          std::cerr << "Error: number of threads must be at least 1."
+                    << std::endl;
+          exit(1);
+        }
+        options.threads = threads;
+      } else if (!std::strncmp(argv[i], "--table=", 8)) {
+        MappedFile table_file(argv[i] + 8);
+        if (!table_file.is_open()) {
+          std::cerr << "Error: cannot open table file " << argv[i] + 8
+                    << "." << std::endl;
+          exit(1);
+        }
+        try {
+          table = Huffman::ReadTable(table_file.data(), table_file.size());
+        } catch (const std::runtime_error &e) {
+          std::cerr << "Error: cannot read table file " << argv[i] + 8
+                    << ": " << e.what() << "." << std::endl;
+          exit(1);
+        }
+        options.table = &table;
+      } else if (!std::strncmp(argv[i], "--range=", 8)) {
+        // Range of the original file given as offset:length
+        std::string range(argv[i] + 8);
+        size_t colon = range.find(':');
+        if (colon == std::string::npos ||
+            !ParseNumber(range.substr(0, colon), range_offset) ||
+            !ParseNumber(range.substr(colon + 1), range_length)) {
+          std::cerr << "Error: range must be given as <offset>:<length>."
+                    << std::endl;
+          exit(1);
+        }
+        use_range = true;
+      } else if (!std::strcmp(argv[i], "--stats") ||
+                 !std::strcmp(argv[i], "--stats=json")) {
+        // Measures go to the standard error, after the files are done
+        options.stats = &stats;
+        json_stats = argv[i][7] == '=';
+      } else {
+        files.push_back(argv[i]);
+      }
+    }
+
     //  Checks if the number of input arguments is correct
-    if (argc < 3) {
-      std::cerr << "Usage: ./zap <inputfile> <zapfile>" << std::endl;
+    if (files.size() < 2) {
+      std::cerr << "Usage: ./unzap [-T <threads>] [--range=<offset>:<length>] "
+                << "[--table=<tablefile>] [--stats[=json]] "
+                << "<zapfile> <outputfile>" << std::endl;
       exit(1);
     }
     Huffman hm;
 
-    std::ifstream inputfile(argv[1]);
-    //  Checks if the correct file was given in the command line
-    if (!inputfile.is_open()) {
-      std::cerr << "Error: cannot open input file " << argv[1]
-                << "." << std::endl;
-      exit(1);
+    // Regular files are read in place, other inputs such as pipes are read
+    // through a stream
+    MappedFile mapped(files[0]);
+    std::ifstream inputfile;
+    if (!mapped.is_open()) {
+      inputfile.open(files[0], std::ifstream::binary);
+      //  Checks if the correct file was given in the command line
+      if (!inputfile.is_open()) {
+        std::cerr << "Error: cannot open input file " << files[0]
+                  << "." << std::endl;
+        exit(1);
+      }
     }
 
-    std::ofstream outputfile(argv[2],
+    // A single thread decoding the whole file reads it once from the start
+    // to the end
+    if (options.threads == 1 && !use_range)
+      mapped.Advise(MADV_SEQUENTIAL);
+
+    std::ofstream outputfile(files[1],
                              std::ofstream::binary | std::ofstream::trunc);
 
-    hm.Decompress(inputfile, outputfile);
+    // Corrupted files, and files coded with another shared table, are
+    // rejected
+    try {
+      if (mapped.is_open() && use_range)
+        hm.DecompressRange(mapped.data(), mapped.size(), outputfile,
+                           range_offset, range_length, options);
+      else if (mapped.is_open())
+        hm.Decompress(mapped.data(), mapped.size(), outputfile, options);
+      else if (use_range)
+        hm.DecompressRange(inputfile, outputfile, range_offset, range_length,
+                           options);
+      else
+        hm.Decompress(inputfile, outputfile, options);
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Error: cannot decompress zap file " << files[0] << ": "
+                << e.what() << "." << std::endl;
+      exit(1);
+    }
+
+    std::cout << "Decompressed zap file " << files[0] << " into output file "
+              << files[1] << std::endl;
 
-    std::cout << "Decompressed zap file " << argv[1] << " into output file "
-              << argv[2] << std::endl;
+    if (json_stats)
+      Huffman::PrintStatsJson(stats, std::cerr);
+    else if (options.stats)
+      Huffman::PrintStats(stats, std::cerr);
 
     return 0;
 }
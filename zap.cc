@@ -1,31 +1,198 @@
+#include <cstring>
+#include <sstream>
+#include <string>
+
 #include "huffman.h"
+#include "mapped_file.h"
+
+// Read a decimal number, return 0 if it isn't one
+size_t ParseNumber(const char *arg) {
+  char *end;
+  size_t number = std::strtoul(arg, &end, 10);
+  return end == arg || *end || *arg == '-' ? 0 : number;
+}
+
+// Read a size such as 4096, 64K, 1M or 1G, return 0 if it isn't one
+size_t ParseSize(const char *arg) {
+  char *end;
+  size_t size = std::strtoul(arg, &end, 10);
+
+  if (end == arg)
+    return 0;
+  if (*end == 'K' || *end == 'k')
+    size <<= 10, end++;
+  else if (*end == 'M' || *end == 'm')
+    size <<= 20, end++;
+  else if (*end == 'G' || *end == 'g')
+    size <<= 30, end++;
+
+  return *end ? 0 : size;
+}
 
 int main(int argc, char* argv[]) {
+    Huffman::CompressOptions options;
+    std::vector<char*> files;
+    Huffman::Stats stats;
+    bool json_stats = false;
+    Huffman::SharedTable table;
+    const char *train_filename = nullptr;
+    bool adaptive = false;
+
+    // Split the options from the file names
+    for (int i = 1; i < argc; i++) {
+      if (!std::strncmp(argv[i], "--max-code-length=", 18)) {
+        options.max_code_length = ParseNumber(argv[i] + 18);
+        if (options.max_code_length < Huffman::kMinCodeLengthLimit ||
+            options.max_code_length > Huffman::kMaxCodeLength) {
+          std::cerr << "Error: code length limit must be between "
+                    << Huffman::kMinCodeLengthLimit << " and "
+                    << Huffman::kMaxCodeLength << "." << std::endl;
+          exit(1);
+        }
+      } else if (!std::strncmp(argv[i], "--block-size=", 13)) {
+        options.block_size = ParseSize(argv[i] + 13);
+        if (!options.block_size ||
+            options.block_size > Huffman::kMaxBlockSize) {
+          std::cerr << "Error: block size must be between 1 and 1G."
+                    << std::endl;
+          exit(1);
+        }
+      } else if (!std::strncmp(argv[i], "--table=", 8)) {
+        MappedFile table_file(argv[i] + 8);
+        if (!table_file.is_open()) {
+          std::cerr << "Error: cannot open table file " << argv[i] + 8
+                    << "." << std::endl;
+          exit(1);
+        }
+        try {
+          table = Huffman::ReadTable(table_file.data(), table_file.size());
+        } catch (const std::runtime_error &e) {
+          std::cerr << "Error: cannot read table file " << argv[i] + 8
+                    << ": " << e.what() << "." << std::endl;
+          exit(1);
+        }
+        options.table = &table;
+      } else if (!std::strncmp(argv[i], "--train=", 8)) {
+        train_filename = argv[i] + 8;
+      } else if (!std::strcmp(argv[i], "--interleaved")) {
+        options.interleaved = true;
+      } else if (!std::strncmp(argv[i], "--context=", 10)) {
+        options.context_groups = std::strtoul(argv[i] + 10, nullptr, 10);
+        if (!options.context_groups ||
+            options.context_groups > Huffman::kMaxContextGroups) {
+          std::cerr << "Error: number of context groups must be between 1 "
+                    << "and " << Huffman::kMaxContextGroups << "."
+                    << std::endl;
+          exit(1);
+        }
+      } else if (!std::strcmp(argv[i], "--adaptive")) {
+        adaptive = true;
+      } else if (!std::strcmp(argv[i], "-T")) {
+        if (i + 1 == argc) {
+          std::cerr << "Error: -T needs a number of threads." << std::endl;
+          exit(1);
+        }
+        options.threads = ParseNumber(argv[++i]);
+        if (!options.threads) {
+          std::cerr << "Error: number of threads must be at least 1."
+                    << std::endl;
+          exit(1);
+        }
+      } else if (!std::strcmp(argv[i], "--stats") ||
+                 !std::strcmp(argv[i], "--stats=json")) {
+        // Measures go to the standard error, after the files are done
+        options.stats = &stats;
+        json_stats = argv[i][7] == '=';
+      } else {
+        files.push_back(argv[i]);
+      }
+    }
+
+    // Train a shared table on every sample file, instead of compressing
+    if (train_filename && !files.empty()) {
+      std::ostringstream samples(std::ios::out | std::ios::binary);
+      for (char *filename : files) {
+        std::ifstream sample(filename, std::ifstream::binary);
+        if (!sample.is_open()) {
+          std::cerr << "Error: cannot open sample file " << filename
+                    << "." << std::endl;
+          exit(1);
+        }
+        samples << sample.rdbuf();
+      }
+
+      std::string data = samples.str();
+      std::ofstream table_file(train_filename,
+                               std::ofstream::binary | std::ofstream::trunc);
+      Huffman::WriteTable(Huffman::TrainTable(data.data(), data.size(),
+                                              options.max_code_length),
+                          table_file);
+
+      std::cout << "Trained table " << train_filename << " on "
+                << data.size() << " bytes of samples" << std::endl;
+      return 0;
+    }
+
     //  Checks if the number of input arguments is correct
-    if (argc < 3) {
-      std::cerr << "Usage: ./zap <inputfile> <zapfile>" << std::endl;
+    if (files.size() < 2) {
+      std::cerr << "Usage: ./zap [--max-code-length=<bits>] "
+                << "[--block-size=<size>] [--interleaved] [-T <threads>] "
+                << "[--table=<tablefile>] [--context=<groups>] "
+                << "[--stats[=json]] "
+                << "<inputfile> <zapfile>" << std::endl
+                << "       ./zap [--max-code-length=<bits>] "
+                << "--train=<tablefile> <samplefile>..." << std::endl
+                << "       ./zap --adaptive <inputfile> <zapfile>"
+                << std::endl;
       exit(1);
     }
-    Huffman hm;
 
-    std::ifstream inputfile(argv[1]);
-    //  Checks if the correct file was given in the command line
-    if (!inputfile.is_open()) {
-      std::cerr << "Error: cannot open input file " << argv[1]
-                << "." << std::endl;
+    // The adaptive code is built along the input, in a single block
+    if (adaptive && (options.interleaved || options.table ||
+                     options.context_groups > 1 || options.stats)) {
+      std::cerr << "Error: --adaptive can't be used with --interleaved, "
+                << "--table, --context or --stats." << std::endl;
       exit(1);
     }
+    Huffman hm;
 
+    // Regular files are read in place, other inputs such as pipes are read
+    // through a stream, as is any input coded as it arrives
+    MappedFile mapped(adaptive ? "" : files[0]);
+    std::ifstream inputfile;
+    if (!mapped.is_open()) {
+      inputfile.open(files[0], std::ifstream::binary);
+      //  Checks if the correct file was given in the command line
+      if (!inputfile.is_open()) {
+        std::cerr << "Error: cannot open input file " << files[0]
+                  << "." << std::endl;
+        exit(1);
+      }
+    }
 
-    std::ofstream outputfile(argv[2],
+    // A single thread reads the input once from the start to the end
+    if (options.threads == 1)
+      mapped.Advise(MADV_SEQUENTIAL);
+
+    std::ofstream outputfile(files[1],
                              std::ofstream::binary | std::ofstream::trunc);
     // truncate the file if already exists
     // open output file in binary
 
-    hm.Compress(inputfile, outputfile);
+    if (adaptive)
+      Huffman::CompressAdaptive(inputfile, outputfile);
+    else if (mapped.is_open())
+      hm.Compress(mapped.data(), mapped.size(), outputfile, options);
+    else
+      hm.Compress(inputfile, outputfile, options);
+
+    std::cout << "Compressed input file " << files[0] << " into zap file "
+              << files[1] << std::endl;
 
-    std::cout << "Compressed input file " << argv[1] << " into zap file "
-              << argv[2] << std::endl;
+    if (json_stats)
+      Huffman::PrintStatsJson(stats, std::cerr);
+    else if (options.stats)
+      Huffman::PrintStats(stats, std::cerr);
 
     return 0;
 }